@@ -9,10 +9,22 @@ See the GNU Lesser General Public License for more details.
 UKNCBTL. If not, see <http://www.gnu.org/licenses/>. */
 
 #include "ESCParser.h"
-#include <iomanip>
+#include "FX80Font.h"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <math.h>
 
 #include "zlib/zlib.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define RASTER_SSE2
+#endif
+
 //////////////////////////////////////////////////////////////////////
 // TxtChunk
 static void printOver(unsigned short& c1, unsigned short c2) {
@@ -153,17 +165,194 @@ void TxtChunk::set(unsigned short ch, int x, int y, int w, int h) {
 	printOver(m_buf[pos], ch);
 }
 
+//////////////////////////////////////////////////////////////////////
+// Glyphs
+
+// Key of the glyph font for the style: the pitch and the attribute bits; never 0
+static unsigned int GlyphStyleKey(const EscGlyphStyle& style)
+{
+    return ((unsigned int)style.pitch << 6) |
+           (style.bold ? 1 : 0) | (style.doublestrike ? 2 : 0) | (style.expanded ? 4 : 0) |
+           (style.underline ? 8 : 0) | (style.superscript ? 16 : 0) | (style.subscript ? 32 : 0);
+}
+
+// The strikes of a glyph in a style are derived once, then only moved to the character position
+const std::vector<EscGlyphDot>& OutputDriver::GetGlyphStrikes(const glyph* gl, const EscGlyphStyle& style)
+{
+    unsigned int key = GlyphStyleKey(style);
+    if (key != m_glyphdotskey)
+    {
+        m_glyphdotslast = &m_glyphdotscache[key];
+        m_glyphdotskey = key;
+    }
+    int index = FontGlyphIndex(gl);
+    std::vector<EscGlyphDot>& dots = m_glyphdotslast->dots[index];
+    if (!m_glyphdotslast->built[index])
+    {
+        GetGlyphDots(gl, style, dots);
+        m_glyphdotslast->built[index] = true;
+    }
+    return dots;
+}
+
+// Glyph and graphics expansion to the strikes. Strike is called for every strike: the virtual WriteStrike
+// for any driver, or the strike of the known driver class called directly, to have it inlined in the loops.
+
+template<bool DoubleStrike, class Strike>
+static void ExpandGlyphStrikes(const Strike& strike, const std::vector<EscGlyphDot>& dots, int x, int y, float r)
+{
+    for (size_t i = 0; i < dots.size(); i++)
+    {
+        float cx = x + dots[i].x;
+        float cy = y + dots[i].y;
+        strike(cx, cy, r);
+        if (DoubleStrike)
+            strike(cx, cy + EscDoubleStrikeShift, r);
+    }
+}
+
+template<class Strike>
+static void ExpandGlyph(const Strike& strike, const std::vector<EscGlyphDot>& dots, int x, int y, const EscGlyphStyle& style)
+{
+    if (style.doublestrike)
+        ExpandGlyphStrikes<true>(strike, dots, x, y, style.GetStrikeRadius());
+    else
+        ExpandGlyphStrikes<false>(strike, dots, x, y, style.GetStrikeRadius());
+}
+
+template<class Strike>
+static void ExpandGraphics(const Strike& strike, const EscGraphics& graphics, int x, int y)
+{
+    int bytes = graphics.pins / 8;  // Bytes a column
+    for (int col = 0; col < graphics.columns; col++)
+    {
+        const unsigned char* data = graphics.data + col * bytes;
+        float cx = float(x + col * graphics.dx);
+        for (int b = 0; b < bytes; b++)
+        {
+            if (data[b] == 0)
+                continue;
+
+            const EscByteBits& bits = EscByteBitsTable[data[b]];
+            for (int i = 0; i < bits.count; i++)
+            {
+                int pin = b * 8 + bits.offsets[i];
+                float cy = float(y + pin * graphics.pinpitch);
+                strike(cx, cy, graphics.radius);
+                if (graphics.doublestrike)
+                    strike(cx, cy + EscDoubleStrikeShift, graphics.radius);
+            }
+        }
+    }
+}
+
+void OutputDriver::WriteGlyph(const glyph* gl, int x, int y, const EscGlyphStyle& style)
+{
+    ExpandGlyph([this](float sx, float sy, float r) { WriteStrike(sx, sy, r); },
+                GetGlyphStrikes(gl, style), x, y, style);
+}
+
+void OutputDriver::WriteGraphics(const EscGraphics& graphics, int x, int y)
+{
+    ExpandGraphics([this](float sx, float sy, float r) { WriteStrike(sx, sy, r); },
+                   graphics, x, y);
+}
+
+// Format the glyph code for a PDF or PostScript string
+static void FormatGlyphCode(char* buffer, size_t size, int code)
+{
+    if (code < 32 || code >= 127)
+        sprintf_s(buffer, size, "\\%03o", code);
+    else if (code == '(' || code == ')' || code == '\\')
+        sprintf_s(buffer, size, "\\%c", code);
+    else
+        sprintf_s(buffer, size, "%c", code);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Bit image graphics
+
+// 1-bit raster of bit image graphics, 1/720 inch pixels, 1 for the dots;
+// the raster starts one strike radius left and above the first column top pin
+struct GraphicsRaster
+{
+    int width, height;
+    int rowbytes;
+    std::vector<unsigned char> bits;
+};
+
+static void RasterizeGraphics(const EscGraphics& graphics, GraphicsRaster& raster)
+{
+    int r = (int)(graphics.radius + 0.5f);
+    raster.width = (graphics.columns - 1) * graphics.dx + 2 * r;
+    raster.height = (graphics.pins - 1) * graphics.pinpitch + 2 * r;
+    raster.rowbytes = (raster.width + 7) / 8;
+    raster.bits.assign(raster.rowbytes * raster.height, 0);
+
+    // The strike covers the pixels with the center within the radius: spans of every row of the disc
+    std::vector<int> spanfrom(2 * r), spanto(2 * r);
+    for (int dy = -r; dy < r; dy++)
+    {
+        int dx = -r;
+        while ((dx + 0.5f) * (dx + 0.5f) + (dy + 0.5f) * (dy + 0.5f) > graphics.radius * graphics.radius)
+            dx++;
+        spanfrom[dy + r] = dx;
+        spanto[dy + r] = -dx;
+    }
+
+    int bytes = graphics.pins / 8;  // Bytes a column
+    for (int col = 0; col < graphics.columns; col++)
+    {
+        const unsigned char* data = graphics.data + col * bytes;
+        int cx = col * graphics.dx + r;
+        for (int b = 0; b < bytes; b++)
+        {
+            if (data[b] == 0)
+                continue;
+
+            const EscByteBits& bits = EscByteBitsTable[data[b]];
+            for (int i = 0; i < bits.count; i++)
+            {
+                int cy = (b * 8 + bits.offsets[i]) * graphics.pinpitch + r;
+                for (int dy = -r; dy < r; dy++)
+                {
+                    unsigned char* row = &raster.bits[(cy + dy) * raster.rowbytes];
+                    for (int x = cx + spanfrom[dy + r]; x < cx + spanto[dy + r]; x++)
+                        row[x >> 3] |= 0x80 >> (x & 7);
+                }
+            }
+        }
+    }
+}
+
+// Deflate the raster, ASCII85-encode it if asked; fails if deflate is not available
+static bool EncodeGraphicsRaster(const GraphicsRaster& raster, const OutputDriverPdfSettings& settings, bool ascii85,
+                                 std::string& encoded)
+{
+    OutputDriverPdfSettings a85settings = settings;
+    a85settings.ascii85 = ascii85;
+    PdfStreamEncoder encoder(a85settings);
+    if (!encoder.Begin())
+        return false;
+
+    OutputSinkString stream;
+    encoder.Write(stream, (const char*)&raster.bits[0], raster.bits.size(), true);
+    encoded.swap(stream.GetString());
+    return true;
+}
+
+
 //////////////////////////////////////////////////////////////////////
 // txt driver
 
-static void flushAsciiTo(TxtChunk &txt, std::ostream &out)
+static void flushAsciiTo(TxtChunk &txt, OutputSink &out)
 {
 	std::string str;
 	txt.appendAscii(str).clear();
 	out << str;
 }
 
-void OutputDriverTxt::WriteEnding()
+void OutputDriverTxt::WriteEnding(int /*pagestotal*/)
 {
 	flushAsciiTo(m_txt.trim(), m_output);
 }
@@ -173,7 +362,7 @@ void OutputDriverTxt::WriteChar(unsigned short ch, int x, int y, int w, int h)
 	if(!m_txt.canSet(x,y,w,h)) {
 		bool eol = y != m_txt.getY();
 		flushAsciiTo(m_txt, m_output);
-		if(eol) m_output << std::endl;
+		if(eol) m_output << '\n';
 	}
 	m_txt.set(ch,x,y,w,h);
 }
@@ -184,15 +373,46 @@ void OutputDriverTxt::WriteChar(unsigned short ch, int x, int y, int w, int h)
 //NOTE: The most recent SVG standard is 1.2 tiny. Multipage support appears in 1.2 full.
 // So, currently SVG does not have multipage support, and browsers can't interpret multipage SVGs.
 
-void OutputDriverSvg::WriteBeginning(int pagestotal)
+void OutputDriverSvg::WriteBeginning()
 {
-    m_output << "<?xml version=\"1.0\"?>" << std::endl;
-    m_output << "<svg xmlns=\"http://www.w3.org/2000/svg\" version=\"1.0\">" << std::endl;
+    m_output << "<?xml version=\"1.0\"?>\n";
+    m_output << "<svg xmlns=\"http://www.w3.org/2000/svg\" xmlns:xlink=\"http://www.w3.org/1999/xlink\" version=\"1.0\">\n";
 }
 
-void OutputDriverSvg::WriteEnding()
+void OutputDriverSvg::WriteEnding(int /*pagestotal*/)
 {
-    m_output << "</svg>" << std::endl;
+    // The symbols are made of the same circles as WriteStrike writes
+    std::vector<EscGlyphDot> dots;
+    if (!glyphsymbols.empty())
+        m_output << "<defs>\n";
+    for (std::map<unsigned int, GlyphSymbols>::const_iterator it = glyphsymbols.begin(); it != glyphsymbols.end(); ++it)
+    {
+        const EscGlyphStyle& style = it->second.style;
+        float cr = style.GetStrikeRadius() / 10.0f;
+        for (int code = 0; code < 256; code++)
+        {
+            if (!it->second.used.test(code))
+                continue;
+
+            char id[24];
+            sprintf_s(id, sizeof(id), "g%X_%d", it->first, code);
+            m_output << "<symbol id=\"" << id << "\" overflow=\"visible\">\n";
+            GetGlyphDots(FontRomGlyph(code), style, dots);
+            for (size_t i = 0; i < dots.size(); i++)
+            {
+                float cx = dots[i].x / 10.0f;
+                float cy = dots[i].y / 10.0f;
+                m_output << "<circle cx=\"" << cx << "\" cy=\"" << cy << "\" r=\"" << cr << "\" />\n";
+                if (style.doublestrike)
+                    m_output << "<circle cx=\"" << cx << "\" cy=\"" << (dots[i].y + EscDoubleStrikeShift) / 10.0f << "\" r=\"" << cr << "\" />\n";
+            }
+            m_output << "</symbol>\n";
+        }
+    }
+    if (!glyphsymbols.empty())
+        m_output << "</defs>\n";
+
+    m_output << "</svg>\n";
 }
 
 void OutputDriverSvg::WriteStrike(float x, float y, float r)
@@ -200,49 +420,241 @@ void OutputDriverSvg::WriteStrike(float x, float y, float r)
     float cx = x / 10.0f;
     float cy = y / 10.0f;
     float cr = r / 10.0f;
-    m_output << "<circle cx=\"" << cx << "\" cy=\"" << cy << "\" r=\"" << cr << "\" />" << std::endl;
+    m_output << "<circle cx=\"" << cx << "\" cy=\"" << cy << "\" r=\"" << cr << "\" />\n";
+}
+
+void OutputDriverSvg::WriteGlyph(const glyph* gl, int x, int y, const EscGlyphStyle& style)
+{
+    static const unsigned short blank[9] = { 0 };
+    if (!style.underline && memcmp(gl->data, blank, sizeof(blank)) == 0)
+        return;  // Nothing to print, e.g. space
+
+    unsigned int key = GlyphStyleKey(style);
+    GlyphSymbols& symbols = glyphsymbols[key];
+    symbols.style = style;
+    int code = FontGlyphIndex(gl);
+    symbols.used.set(code);
+
+    char id[24];
+    sprintf_s(id, sizeof(id), "g%X_%d", key, code);
+    m_output << "<use xlink:href=\"#" << id << "\" x=\"" << x / 10.0f << "\" y=\"" << y / 10.0f << "\" />\n";
+}
+
+void OutputDriverSvg::AppendPage(const OutputDriver& pagedriver, const std::string& pagedata)
+{
+    // The page refers to the symbols defined at the document end
+    const OutputDriverSvg& svgpagedriver = static_cast<const OutputDriverSvg&>(pagedriver);
+    for (std::map<unsigned int, GlyphSymbols>::const_iterator it = svgpagedriver.glyphsymbols.begin(); it != svgpagedriver.glyphsymbols.end(); ++it)
+    {
+        GlyphSymbols& symbols = glyphsymbols[it->first];
+        symbols.style = it->second.style;
+        symbols.used |= it->second.used;
+    }
+
+    m_output.Write(pagedata.data(), pagedata.size());
 }
 
 
 //////////////////////////////////////////////////////////////////////
 // PostScript driver
 
-void OutputDriverPostScript::WriteBeginning(int pagestotal)
+// Prologue part defining the glyph fonts, the ROM glyph rows are added after it; see GetGlyphDots.
+// fxfont selects the font for a glyph style key, building it at the first use;
+// glyph space units are 1/720 inch, the glyphs are made of the same dots as dotxyr does.
+static const char* PostScriptGlyphFontProcs =
+    "/fxencoding 256 array def\n"
+    "0 1 255 { fxencoding exch /.notdef put } for\n"
+    "/fxfonts 64 dict def\n"
+    "/fxtmp 16 dict def\n"
+    "/fxflag { flags exch and 0 ne } bind def\n"
+    "/fxdot1 { 2 copy exch R add exch moveto R 0 360 arc } bind def\n"
+    "/fxdot { Double { 2 copy 0.33333333 add fxdot1 } if fxdot1 } bind def\n"  // EscDoubleStrikeShift
+    "/fxrow {\n"
+    "  0 1 8 {\n"
+    "    /col exch def\n"
+    "    data col neg bitshift 1 and 1 eq Under line 8 eq and or {\n"
+    "      col step mul y fxdot\n"
+    "      Expanded { col 1 add step mul y fxdot } if\n"
+    "    } if\n"
+    "  } for\n"
+    "  /y y 12 add def\n"
+    "} bind def\n"
+    "/fxbuild {\n"
+    "  exch begin fxtmp begin\n"
+    "  /rows fxrom 3 -1 roll get def\n"
+    "  /step Pitch 11 div def\n"
+    "  /y Sub { 48 } { 0 } ifelse def\n"
+    "  /prev 0 def\n"
+    "  Pitch 0 -9 -9 step 9 mul 9 add 107 setcachedevice\n"
+    "  newpath\n"
+    "  0 1 8 {\n"
+    "    /line exch def\n"
+    "    /data rows line get def\n"
+    "    Super Sub or {\n"
+    "      line 1 and 0 eq { /prev data def } { /data data prev or def fxrow } ifelse\n"
+    "    } { fxrow } ifelse\n"
+    "  } for\n"
+    "  Under { 9 step mul 96 fxdot } if\n"
+    "  fill\n"
+    "  end end\n"
+    "} bind def\n"
+    "/fxfont {\n"
+    "  fxfonts 1 index known not {\n"
+    "    fxtmp begin\n"
+    "    /key exch def\n"
+    "    /flags key 63 and def\n"
+    "    /pitch key -6 bitshift def\n"
+    "    12 dict begin\n"
+    "      /FontType 3 def\n"
+    "      /FontMatrix [0.1 0 0 0.1 0 0] def\n"
+    "      /FontBBox [-9 -9 pitch 11 div 9 mul 9 add 107] def\n"
+    "      /Encoding fxencoding def\n"
+    "      /BuildChar /fxbuild load def\n"
+    "      /Pitch pitch def\n"
+    "      /R 1 fxflag { 8 } { 6 } ifelse def\n"
+    "      /Double 2 fxflag def\n"
+    "      /Expanded 4 fxflag def\n"
+    "      /Under 8 fxflag def\n"
+    "      /Super 16 fxflag def\n"
+    "      /Sub 32 fxflag def\n"
+    "      key currentdict\n"
+    "    end\n"
+    "    definefont fxfonts key 2 index put pop\n"
+    "    key end\n"
+    "  } if\n"
+    "  fxfonts exch get setfont\n"
+    "} bind def\n"
+    // x y w h fximage, the image mask data follows, deflated and ASCII85-encoded; see GraphicsRaster
+    "/fximage {\n"
+    "  fxtmp begin\n"
+    "  /h exch def /w exch def\n"
+    "  gsave translate w 10 div h 10 div scale\n"
+    "  /a85 currentfile /ASCII85Decode filter def\n"
+    "  w h true [w 0 0 h 0 0] a85 /FlateDecode filter imagemask\n"
+    "  a85 flushfile\n"
+    "  grestore\n"
+    "  end\n"
+    "} bind def\n";
+
+void OutputDriverPostScript::WriteBeginning()
 {
-    m_output << "%!PS-Adobe-2.0" << std::endl;
-    m_output << "%%Creator: ESCParser" << std::endl;
-    m_output << "%%Pages: " << pagestotal << std::endl;
+    m_output << "%!PS-Adobe-2.0\n";
+    m_output << "%%Creator: ESCParser\n";
+    m_output << "%%LanguageLevel: 3\n";  // FlateDecode for the graphics
+    m_output << "%%Pages: (atend)\n";
 
     // PS procedure used to simplify WriteStrike output
-    m_output << "/dotxyr { newpath 0 360 arc fill } def" << std::endl;
+    m_output << "/dotxyr { newpath 0 360 arc fill } def\n";
+
+    // The font ROM, nine rows for every glyph, bit 0 is the leftmost column
+    m_output << "/fxrom [\n";
+    for (int code = 0; code < 256; code++)
+    {
+        const unsigned short* data = FontRomGlyph(code)->data;
+        m_output << "[";
+        for (int line = 0; line < 9; line++)
+            m_output << (line > 0 ? " " : "") << data[line];
+        m_output << "]\n";
+    }
+    m_output << "] def\n";
+    m_output << PostScriptGlyphFontProcs;
 }
 
-void OutputDriverPostScript::WriteEnding()
+void OutputDriverPostScript::WriteEnding(int pagestotal)
 {
-    m_output << "%%EOF" << std::endl;
+    m_output << "%%Trailer\n";
+    m_output << "%%Pages: " << pagestotal << '\n';
+    m_output << "%%EOF\n";
 }
 
 void OutputDriverPostScript::WritePageBeginning(int pageno)
 {
-    m_output << "%%Page: " << pageno << " " << pageno << std::endl;
-    m_output << "0 850 translate 1 -1 scale" << std::endl;
-    m_output << "0 setgray" << std::endl;
+    m_output << "%%Page: " << pageno << " " << pageno << '\n';
+    m_output << "0 850 translate 1 -1 scale\n";
+    m_output << "0 setgray\n";
+
+    textfont = 0;  // Every page selects its fonts
+    stringopen = false;
 }
 
 void OutputDriverPostScript::WritePageEnding()
 {
-    m_output << "showpage" << std::endl;
+    EndText();
+    m_output << "showpage\n";
 }
 
 void OutputDriverPostScript::WriteStrike(float x, float y, float r)
 {
+    EndText();
+
     float cx = x / 10.0f;
     float cy = y / 10.0f;
     float cr = r / 10.0f;
 
     char buffer[24];
     sprintf_s(buffer, sizeof(buffer), "%.2f %.2f %.1f", cx, cy, cr);
-    m_output << buffer << " dotxyr" << std::endl;
+    m_output << buffer << " dotxyr\n";
+}
+
+void OutputDriverPostScript::WriteGlyph(const glyph* gl, int x, int y, const EscGlyphStyle& style)
+{
+    unsigned int key = GlyphStyleKey(style);
+
+    // The glyphs go to one string while every glyph starts where the previous one advanced to;
+    // the lines are kept within 255 characters
+    if (stringopen && (key != textfont || x != textx || y != texty || textbuf.length() > 200))
+        EndText();
+    if (key != textfont)
+    {
+        m_output << key << " fxfont\n";
+        textfont = key;
+    }
+
+    char buffer[48];
+    if (!stringopen)
+    {
+        sprintf_s(buffer, sizeof(buffer), "%g %g moveto (", x / 10.0f, y / 10.0f);
+        textbuf = buffer;
+        stringopen = true;
+    }
+    FormatGlyphCode(buffer, sizeof(buffer), FontGlyphIndex(gl));
+    textbuf.append(buffer);
+
+    textx = x + style.pitch;
+    texty = y;
+}
+
+void OutputDriverPostScript::WriteGraphics(const EscGraphics& graphics, int x, int y)
+{
+    GraphicsRaster raster;
+    RasterizeGraphics(graphics, raster);
+    std::string encoded;
+    if (!EncodeGraphicsRaster(raster, OutputDriverPdfSettings(), true, encoded))
+    {
+        OutputDriver::WriteGraphics(graphics, x, y);
+        return;
+    }
+
+    EndText();
+    int r = (int)(graphics.radius + 0.5f);
+    m_output << (x - r) / 10.0f << " " << (y - r) / 10.0f << " " << raster.width << " " << raster.height << " fximage\n";
+    // Lines within 255 characters, the end marker ~> kept whole
+    size_t length = encoded.length() - 2;
+    for (size_t i = 0; i < length; i += 80)
+    {
+        m_output.Write(encoded.data() + i, length - i < 80 ? length - i : 80);
+        m_output << '\n';
+    }
+    m_output << "~>\n";
+}
+
+void OutputDriverPostScript::EndText()
+{
+    if (!stringopen)
+        return;
+
+    m_output << textbuf << ") show\n";
+    stringopen = false;
 }
 
 //////////////////////////////////////////////////////////////////////
@@ -254,192 +666,706 @@ void ascii85_encode_tuple(const unsigned char* src, char* dst);
 const float PdfPageSizeX = 595.0f;  // A4 210mm / 25.4 * 72, rounded
 const float PdfPageSizeY = 842.0f;  // A4 297mm / 25.4 * 72, rounded
 
-void OutputDriverPdf::WriteBeginning(int pagestotal)
+// Objects of a page: page, content stream, content stream length
+const int PdfObjectsPerPage = 3;
+// Page objects: 5, 8, 11, etc.; objects 1 to 4 are the info, catalog, page tree and resources
+inline int PdfPageObjectNumber(int pageno) { return pageno * PdfObjectsPerPage + 2; }
+// Largest graphics mask data written as an inline image, bytes; larger go to image XObjects
+const size_t PdfInlineImageMaxSize = 4096;
+
+//////////////////////////////////////////////////////////////////////
+// PDF stream encoder
+
+PdfStreamEncoder::PdfStreamEncoder(const OutputDriverPdfSettings& settings) :
+    m_settings(settings), m_zstrm(0), m_zbuffer(64 * 1024), m_a85count(0)
+{
+}
+
+PdfStreamEncoder::~PdfStreamEncoder()
+{
+    if (m_zstrm != 0)
+    {
+        deflateEnd(m_zstrm);
+        delete m_zstrm;
+    }
+}
+
+bool PdfStreamEncoder::Begin()
+{
+    m_a85count = 0;
+    if (m_zstrm == 0)
+    {
+        m_zstrm = new z_stream;  memset(m_zstrm, 0, sizeof(z_stream));
+        if (deflateInit2(m_zstrm, m_settings.zlevel, Z_DEFLATED, MAX_WBITS, 8, m_settings.zstrategy) != Z_OK)
+        {
+            delete m_zstrm;  m_zstrm = 0;  // Write the data uncompressed
+            return false;
+        }
+        return true;
+    }
+    return deflateReset(m_zstrm) == Z_OK;
+}
+
+void PdfStreamEncoder::Write(OutputSink& output, const char* data, size_t size, bool finish)
+{
+    if (m_zstrm == 0)  // No compression
+    {
+        output.Write(data, size);
+        return;
+    }
+
+    m_zstrm->next_in = (Bytef*) data;
+    m_zstrm->avail_in = (uInt) size;
+    while (true)
+    {
+        m_zstrm->next_out = &m_zbuffer[0];
+        m_zstrm->avail_out = (uInt) m_zbuffer.size();
+        int result = deflate(m_zstrm, finish ? Z_FINISH : Z_NO_FLUSH);
+        WriteEncoded(output, &m_zbuffer[0], m_zbuffer.size() - m_zstrm->avail_out);
+        if (finish ? result != Z_OK : m_zstrm->avail_out != 0)
+            break;  // Z_STREAM_END, or all the input consumed
+    }
+
+    if (finish)
+        WriteEncodedEnd(output);
+}
+
+void PdfStreamEncoder::WriteEncoded(OutputSink& output, const unsigned char* data, size_t size)
+{
+    if (!m_settings.ascii85)
+    {
+        output.Write((const char*)data, size);
+        return;
+    }
+
+    char encoded[1024 + 8];
+    size_t length = 0;
+    for (; size > 0; size--)
+    {
+        m_a85tuple[m_a85count++] = *data++;
+        if (m_a85count < 4)
+            continue;
+
+        ascii85_encode_tuple(m_a85tuple, encoded + length);
+        length += encoded[length] == 'z' ? 1 : 5;
+        m_a85count = 0;
+        if (length >= 1024)
+        {
+            output.Write(encoded, length);
+            length = 0;
+        }
+    }
+    output.Write(encoded, length);
+}
+
+void PdfStreamEncoder::WriteEncodedEnd(OutputSink& output)
+{
+    if (!m_settings.ascii85)
+        return;
+
+    if (m_a85count > 0)  // Last partial tuple: pad with zeros, write count+1 characters
+    {
+        char encoded[6];
+        memset(m_a85tuple + m_a85count, 0, 4 - m_a85count);
+        ascii85_encode_tuple(m_a85tuple, encoded);
+        if (encoded[0] == 'z')
+            memcpy(encoded, "!!!!!", 5);
+        output.Write(encoded, m_a85count + 1);
+        m_a85count = 0;
+    }
+    output << "~>";
+}
+
+
+//////////////////////////////////////////////////////////////////////
+// PDF page compression threads
+
+// Page handed off to the compression threads
+struct PdfPageJob
+{
+    int pageno;
+    std::string content;  // Page content, freed when deflated
+    std::string stream;   // Content stream data, deflated and encoded
+    bool compressed;      // Is the stream data deflated
+    bool done;
+};
+
+// Deflates the page contents on worker threads; the pages come out in the order they went in
+class PdfCompressor
+{
+public:
+    PdfCompressor(const OutputDriverPdfSettings& settings);
+    ~PdfCompressor();
+
+public:
+    void Submit(PdfPageJob* job);
+    // Take the first page submitted, when it is deflated; 0 if no pages left,
+    // or if the page is not ready and wait is not set
+    PdfPageJob* Next(bool wait);
+    // Number of pages submitted and not taken yet
+    size_t GetPendingCount() const { return m_pending.size(); }
+
+private:
+    void WorkerProc();
+
+private:
+    OutputDriverPdfSettings m_settings;
+    std::vector<std::thread> m_workers;
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::deque<PdfPageJob*> m_queue;    // Pages to deflate, shared with the workers
+    std::deque<PdfPageJob*> m_pending;  // Pages in order, for the writer thread only
+    bool m_stop;
+};
+
+PdfCompressor::PdfCompressor(const OutputDriverPdfSettings& settings) :
+    m_settings(settings), m_stop(false)
+{
+    for (int i = 0; i < settings.zthreads; i++)
+        m_workers.push_back(std::thread(&PdfCompressor::WorkerProc, this));
+}
+
+PdfCompressor::~PdfCompressor()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+        m_cond.notify_all();
+    }
+    for (size_t i = 0; i < m_workers.size(); i++)
+        m_workers[i].join();
+    for (size_t i = 0; i < m_pending.size(); i++)
+        delete m_pending[i];
+}
+
+void PdfCompressor::Submit(PdfPageJob* job)
+{
+    job->done = false;
+    m_pending.push_back(job);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_queue.push_back(job);
+    m_cond.notify_all();
+}
+
+PdfPageJob* PdfCompressor::Next(bool wait)
+{
+    if (m_pending.empty())
+        return 0;
+
+    PdfPageJob* job = m_pending.front();
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (!job->done && !wait)
+        return 0;
+    m_cond.wait(lock, [&]() { return job->done; });
+
+    m_pending.pop_front();
+    return job;
+}
+
+void PdfCompressor::WorkerProc()
+{
+    PdfStreamEncoder encoder(m_settings);
+    while (true)
+    {
+        PdfPageJob* job;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cond.wait(lock, [&]() { return m_stop || !m_queue.empty(); });
+            if (m_stop)
+                return;
+            job = m_queue.front();
+            m_queue.pop_front();
+        }
+
+        OutputSinkString stream;
+        job->compressed = encoder.Begin();
+        encoder.Write(stream, job->content.data(), job->content.size(), true);
+        job->stream.swap(stream.GetString());
+        std::string().swap(job->content);
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        job->done = true;
+        m_cond.notify_all();
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////
+
+OutputDriverPdf::OutputDriverPdf(OutputSink& output, const OutputDriverPdfSettings& asettings) :
+    OutputDriver(output), settings(asettings), encoder(asettings), compressor(0), pagecurrent(0),
+    streamstart(0), objnolength(0), textopen(false), stringopen(false), textfont(0), textx(0), texty(0), pageimages(0)
+{
+    strikesize = 0.1f;
+    docstart = output.Tell();
+}
+
+OutputDriverPdf::~OutputDriverPdf()
+{
+    delete compressor;
+}
+
+void OutputDriverPdf::WriteBeginning()
 {
+    docstart = m_output.Tell();
     xref.push_back(PdfXrefItem(0, 65535, 'f'));
-    m_output << "%PDF-1.3" << std::endl;
+    m_output << "%PDF-1.3\n";
+    if (!settings.ascii85)
+        m_output << "%\xe2\xe3\xcf\xd3\n";  // Binary file marker
 
-    xref.push_back(PdfXrefItem(m_output.tellp(), 0, 'n'));
+    xref.push_back(PdfXrefItem(GetOffset(), 0, 'n'));
     m_output << "1 0 obj <<";
     m_output << "/Producer (ESCParser utility by Nikita Zimin)";
-    m_output << ">>" << std::endl << "endobj" << std::endl;
+    m_output << ">>\n" << "endobj\n";
 
-    xref.push_back(PdfXrefItem(m_output.tellp(), 0, 'n'));
-    m_output << "2 0 obj <</Type /Catalog /Pages 3 0 R>>" << std::endl;
-    m_output << "endobj" << std::endl;
+    xref.push_back(PdfXrefItem(GetOffset(), 0, 'n'));
+    m_output << "2 0 obj <</Type /Catalog /Pages 3 0 R>>\n";
+    m_output << "endobj\n";
 
-    xref.push_back(PdfXrefItem(m_output.tellp(), 0, 'n'));
+    // Object 3, the page tree, and object 4, the resources shared by the pages,
+    // are written after the last page, see WriteEnding
+    xref.push_back(PdfXrefItem(0, 0, 'n'));
+    xref.push_back(PdfXrefItem(0, 0, 'n'));
+}
+
+void OutputDriverPdf::WriteEnding(int pagestotal)
+{
+    if (compressor != 0)
+        WriteFinishedPages(0);
+
+    std::string resources("<<");
+    WriteGlyphFonts(resources);
+    WriteGraphicsImages(resources);
+    resources.append(" >>");
+    xref[4].offset = GetOffset();
+    m_output << "4 0 obj " << resources << "\n";
+    m_output << "endobj\n";
+
+    xref[3].offset = GetOffset();
     m_output << "3 0 obj <</Type /Pages /Kids [";
     for (int i = 0; i < pagestotal; i++)
     {
         if (i > 0)
             m_output << " ";
-        m_output << i * 3 + 4 << " 0 R";  // Page objects: 4, 7, 10, etc.
+        m_output << PdfPageObjectNumber(i + 1) << " 0 R";
     }
-    m_output << "] /Count " << pagestotal << ">>" << std::endl;
-    m_output << "endobj" << std::endl;
-}
+    m_output << "] /Count " << pagestotal << ">>\n";
+    m_output << "endobj\n";
 
-void OutputDriverPdf::WriteEnding()
-{
-    std::streamoff startxref = m_output.tellp();
-    m_output << "xref" << std::endl;
-    m_output << "0 " << xref.size() << std::endl;
+    unsigned long long startxref = GetOffset();
+    m_output << "xref\n";
+    m_output << "0 " << xref.size() << '\n';
     for (std::vector<PdfXrefItem>::iterator it = xref.begin(); it != xref.end(); ++it)
     {
-        m_output << std::setw(10) << std::setfill('0') << (*it).offset << " ";
-        m_output << std::setw(5) << (*it).size << " ";
-        m_output << (*it).flag << std::endl;
+        char buffer[24];
+        sprintf_s(buffer, sizeof(buffer), "%010llu %05d %c \n", (*it).offset, (*it).size, (*it).flag);  // 20 bytes
+        m_output << buffer;
     }
 
-    m_output << "trailer" << std::endl;
-    m_output << "<</Size " << xref.size() << " /Root 2 0 R /Info 1 0 R>>" << std::endl;
-    m_output << "startxref" << std::endl;
-    m_output << startxref << std::endl;
-    m_output << "%%EOF" << std::endl;
+    m_output << "trailer\n";
+    m_output << "<</Size " << xref.size() << " /Root 2 0 R /Info 1 0 R>>\n";
+    m_output << "startxref\n";
+    m_output << startxref << '\n';
+    m_output << "%%EOF\n";
 }
 
 void OutputDriverPdf::WritePageBeginning(int pageno)
 {
-    xref.push_back(PdfXrefItem(m_output.tellp(), 0, 'n'));
-    int objnopage   = pageno * 3 + 1;  // 4, 7, 10, etc.
-    int objnofont   = pageno * 3 + 2;  // 5, 8, 11, etc.
-    int objnostream = pageno * 3 + 3;  // 6, 9, 12, etc.
+    pagecurrent = pageno;
+    if (settings.zthreads > 0)
+    {
+        // The page goes to the compression threads at its end; meanwhile write out what is ready
+        if (compressor == 0)
+            compressor = new PdfCompressor(settings);
+        WriteFinishedPages(settings.zthreads * 2);
+    }
+    else
+    {
+        // The content stream is deflated while the page is interpreted
+        bool compressed = encoder.Begin();
+        WritePageObjects(pageno, compressed);
+    }
+
+    strikesize = 0.0f;
+    pageimages = 0;
+    pagebuf.clear();
+    pagebuf.append("1 J");  // Round cap
+    textopen = stringopen = false;
+}
+
+void OutputDriverPdf::WritePageObjects(int pageno, bool compressed)
+{
+    xref.push_back(PdfXrefItem(GetOffset(), 0, 'n'));
+    int objnopage   = PdfPageObjectNumber(pageno);  // 5, 8, 11, etc.
+    int objnostream = objnopage + 1;                // 6, 9, 12, etc.
+    objnolength     = objnopage + 2;                // 7, 10, 13, etc.
     m_output << objnopage << " 0 obj<</Type /Page /Parent 3 0 R ";
     m_output << "/MediaBox [0 0 " << PdfPageSizeX << " " << PdfPageSizeY << "] ";  // Page bounds
     m_output << "/Contents " << objnostream << " 0 R ";
-    m_output << "/Resources << /Font << /F1 "<<objnofont<<" 0 R >> >>" << std::endl;  // Resources is required key
-    m_output << ">> endobj" << std::endl;
+    m_output << "/Resources 4 0 R";  // Resources is required key
+    m_output << ">> endobj\n";
 
-	xref.push_back(PdfXrefItem(m_output.tellp(), 0, 'n'));
-    m_output << objnofont << " 0 obj << /Type /Font /Subtype /Type1 /BaseFont /Courier >>" << std::endl;
-    m_output << "endobj" << std::endl;
+    // The stream length is known at the stream end only, and goes to a separate object
+    xref.push_back(PdfXrefItem(GetOffset(), 0, 'n'));
+    m_output << objnostream << " 0 obj<</Length " << objnolength << " 0 R";
+    if (compressed)
+        m_output << (settings.ascii85 ? " /Filter [/ASCII85Decode /FlateDecode]" : " /Filter /FlateDecode");
+    m_output << ">>stream\n";
+    streamstart = GetOffset();
+}
 
-    xref.push_back(PdfXrefItem(m_output.tellp(), 0, 'n'));
-    m_output << objnostream << " 0 obj<<";
+void OutputDriverPdf::WritePageObjectsEnd(unsigned long long streamlength)
+{
+    m_output << "\nendstream\nendobj\n";
 
-    strikesize = 0.0f;
-    pagebuf.clear();
-    pagebuf.append("1 J");  // Round cap
-	m_txtbuf.clear();
-	m_txt.clear();
-}
-
-static void addPdfBT(std::string &str, TxtChunk &txt) {
-	if(txt.trim().size()) {
-		char buf[64];
-		float cx = txt.getX() / 10.0f;
-		float cy = PdfPageSizeY - txt.getY() / 10.0f;
-		float cw = txt.getW() / 10.0f;
-		float ch = txt.getH() / 10.0f;
-
-		// sprintf(buf, " BT /F1 %g Tf %g 100.0 Tz %g %g Tm 0 Tr (",
-			// 12.0f, 60.0f, cx-1, cy-7.5);
-		
-		// good for google but bad for edge
-		//sprintf(buf, " %g 0 0 %g %g %g Tm (",
-		//		(cw*100)/60, ch*.559f, cx-1, cy-.559*ch + 1.5);
-		
-		sprintf(buf, " %g 0 0 %g %g %g Tm (",
-				(cw*100)/60, ch*.7f, cx-1, cy-6);
-		
-		// sprintf(buf, " BT /F1 9 Tf %g %g Td (", cx, cy);
-		str.append(buf);
-		txt.appendWinAnsi(str);
-		str.append(") Tj");
-	}
-	txt.clear();
+    xref.push_back(PdfXrefItem(GetOffset(), 0, 'n'));
+    m_output << objnolength << " 0 obj\n" << streamlength << "\nendobj\n";
 }
 
 void OutputDriverPdf::WritePageEnding()
 {
-	addPdfBT(m_txtbuf, m_txt);
-	pagebuf.append("\nBT /F1 1 Tf 3 Tr");
-	pagebuf.append(m_txtbuf); 
-	pagebuf.append(" ET");
-	m_txtbuf.clear();
-	
-    // Preparing for inflate
-    size_t outsize = pagebuf.length() + pagebuf.length() / 2 + 200;
-    outsize = (outsize + 3) / 4 * 4;  // Make sure we have 4-byte aligned size
-    Bytef* zbuffer = new Bytef[outsize];  memset(zbuffer, 0, outsize);
-    z_stream zstrm;  memset(&zstrm, 0, sizeof(zstrm));
-    zstrm.avail_in = pagebuf.length();
-    zstrm.avail_out = outsize;
-    zstrm.next_in = (Bytef*) pagebuf.c_str();
-    zstrm.next_out = zbuffer;
-    // Trying to inflate
-    bool inflatedok = false;
-    int rsti = deflateInit(&zstrm, Z_DEFAULT_COMPRESSION);
-    if (rsti == Z_OK)
-    {
-        int rst2 = deflate(&zstrm, Z_FINISH);
-        if (rst2 >= 0)
-            inflatedok = true;
-    }
-    size_t inflatesize = zstrm.total_out;
-
-    if (inflatedok)
-    {
-        std::string pagebufz;
-        char buffer[6];  memset(buffer, 0, sizeof(buffer));
-        for (size_t i = 0; i < inflatesize; i += 4)
-        {
-            unsigned char * bytes = zbuffer + i;
-            ascii85_encode_tuple(bytes, buffer);
-            pagebufz.append(buffer);
-        }
-        pagebufz.append("~>");
+    EndText();
 
-        m_output << "/Length " << pagebufz.length() << " /Filter [/ASCII85Decode /FlateDecode]>>stream" << std::endl;
-        m_output << pagebufz.c_str() << std::endl;
-        m_output << "endstream" << std::endl << "endobj" << std::endl;
-    }
-    else
+    if (compressor != 0)
     {
-        m_output << "/Length " << pagebuf.length() << ">>stream" << std::endl;
-        m_output << pagebuf.c_str() << std::endl;
-        m_output << "endstream" << std::endl << "endobj" << std::endl;
+        PdfPageJob* job = new PdfPageJob;
+        job->pageno = pagecurrent;
+        job->content.swap(pagebuf);
+        compressor->Submit(job);
+        WriteFinishedPages(settings.zthreads * 2);  // Bound the memory held by the pages in progress
+        return;
     }
 
-    deflateEnd(&zstrm);
-    delete[] zbuffer;  zbuffer = 0;
+    DeflateContent(true);
+    WritePageObjectsEnd(GetOffset() - streamstart);
 }
 
-void OutputDriverPdf::WriteChar(unsigned short ch, int x, int y, int w, int h) 
+void OutputDriverPdf::DeflateContent(bool finish)
 {
-	if(!m_txt.canSet(x,y,w,h)) addPdfBT(m_txtbuf, m_txt);
-	m_txt.set(ch,x,y,w,h);
+    encoder.Write(m_output, pagebuf.data(), pagebuf.size(), finish);
+    pagebuf.clear();
+}
+
+void OutputDriverPdf::WriteFinishedPages(size_t maxpending)
+{
+    while (PdfPageJob* job = compressor->Next(compressor->GetPendingCount() > maxpending))
+    {
+        WritePageObjects(job->pageno, job->compressed);
+        m_output.Write(job->stream.data(), job->stream.size());
+        WritePageObjectsEnd(job->stream.size());
+        delete job;
+    }
+}
+
+void OutputDriverPdf::AppendPage(const OutputDriver& pagedriver, const std::string& pagedata)
+{
+    // The page objects were written at offsets relative to the page data
+    const OutputDriverPdf& pdfpagedriver = static_cast<const OutputDriverPdf&>(pagedriver);
+    unsigned long long pageoffset = GetOffset();
+    for (std::vector<PdfXrefItem>::const_iterator it = pdfpagedriver.xref.begin(); it != pdfpagedriver.xref.end(); ++it)
+        xref.push_back(PdfXrefItem(pageoffset + (*it).offset, (*it).size, (*it).flag));
+
+    // The page refers to the glyph fonts by their style keys
+    for (std::map<unsigned int, GlyphFont>::const_iterator it = pdfpagedriver.glyphfonts.begin(); it != pdfpagedriver.glyphfonts.end(); ++it)
+    {
+        GlyphFont& font = glyphfonts[it->first];
+        font.style = it->second.style;
+        font.used |= it->second.used;
+    }
+    images.insert(images.end(), pdfpagedriver.images.begin(), pdfpagedriver.images.end());
+
+    m_output.Write(pagedata.data(), pagedata.size());
 }
 
 void OutputDriverPdf::WriteStrike(float x, float y, float r)
 {
     char buffer[80];
 
+    EndText();  // No path operators in a text object
+
     if (strikesize != r / 5.0f)
     {
         strikesize = r / 5.0f;
         sprintf_s(buffer, sizeof(buffer), " %g w", strikesize);  // Line width
-        pagebuf.append(buffer);
+        AppendContent(buffer);
     }
 
     float cx = x / 10.0f;
     float cy = PdfPageSizeY - y / 10.0f;
 
     sprintf_s(buffer, sizeof(buffer), " %g %g m %g %g l s", cx, cy, cx, cy);
-    pagebuf.append(buffer);
+    AppendContent(buffer);
 }
 
-//////////////////////////////////////////////////////////////////////
-// ASCII85 encoding for PDF
+void OutputDriverPdf::WriteGlyph(const glyph* gl, int x, int y, const EscGlyphStyle& style)
+{
+    unsigned int key = GlyphStyleKey(style);
+    GlyphFont& font = glyphfonts[key];
+    font.style = style;
+    int code = FontGlyphIndex(gl);
+    font.used.set(code);
 
-typedef unsigned int  uint32_t;
-// make sure uint32_t is 32-bit
-typedef char Z85_uint32_t_static_assert[(sizeof(uint32_t) * 8 == 32) * 2 - 1];
+    char buffer[80];
+    if (!textopen)
+    {
+        AppendContent("\nBT");
+        textopen = true;
+        textfont = ~0u;
+        textx = texty = -1;  // No text position yet
+    }
 
-#define DIV85_MAGIC 3233857729ULL
-// make sure magic constant is 64-bit
-typedef char Z85_div85_magic_static_assert[(sizeof(DIV85_MAGIC) * 8 == 64) * 2 - 1];
+    // The glyphs go to one string while every glyph starts where the previous one advanced to
+    if (stringopen && (key != textfont || x != textx || y != texty))
+    {
+        AppendContent(") Tj");
+        stringopen = false;
+    }
+    if (key != textfont)
+    {
+        sprintf_s(buffer, sizeof(buffer), " /G%X 1 Tf", key);
+        AppendContent(buffer);
+        textfont = key;
+    }
+    if (!stringopen)
+    {
+        if (x != textx || y != texty)
+        {
+            sprintf_s(buffer, sizeof(buffer), " 1 0 0 1 %g %g Tm", x / 10.0f, PdfPageSizeY - y / 10.0f);
+            AppendContent(buffer);
+        }
+        AppendContent(" (");
+        stringopen = true;
+    }
+
+    FormatGlyphCode(buffer, sizeof(buffer), code);
+    AppendContent(buffer);
+
+    textx = x + style.pitch;
+    texty = y;
+}
+
+void OutputDriverPdf::WriteGraphics(const EscGraphics& graphics, int x, int y)
+{
+    GraphicsRaster raster;
+    RasterizeGraphics(graphics, raster);
+    bool inlineimage = raster.bits.size() <= PdfInlineImageMaxSize;
+    std::string encoded;
+    if (!EncodeGraphicsRaster(raster, settings, inlineimage || settings.ascii85, encoded))
+    {
+        OutputDriver::WriteGraphics(graphics, x, y);
+        return;
+    }
+
+    EndText();
+    int r = (int)(graphics.radius + 0.5f);
+    char buffer[160];
+    sprintf_s(buffer, sizeof(buffer), "\nq %g 0 0 %g %g %g cm",
+              raster.width / 10.0f, raster.height / 10.0f,
+              (x - r) / 10.0f, PdfPageSizeY - (y - r + raster.height) / 10.0f);
+    AppendContent(buffer);
+
+    if (inlineimage)
+    {
+        // Small image inline, the ASCII85 end marker ends the data
+        sprintf_s(buffer, sizeof(buffer), " BI /IM true /W %d /H %d /D [1 0] /F [/A85 /Fl] ID\n", raster.width, raster.height);
+        AppendContent(buffer);
+        AppendContent(encoded.c_str());
+        AppendContent("\nEI Q");
+        return;
+    }
+
+    // Image XObject, written after the pages so that the page objects stay the same, see WriteGraphicsImages
+    images.push_back(GraphicsImage());
+    GraphicsImage& image = images.back();
+    image.pageno = pagecurrent;
+    image.index = ++pageimages;
+    image.width = raster.width;
+    image.height = raster.height;
+    image.data.swap(encoded);
+
+    sprintf_s(buffer, sizeof(buffer), " /Im%d_%d Do Q", image.pageno, image.index);
+    AppendContent(buffer);
+}
+
+void OutputDriverPdf::EndText()
+{
+    if (!textopen)
+        return;
+
+    if (stringopen)
+        AppendContent(") Tj");
+    AppendContent(" ET");
+    textopen = stringopen = false;
+}
+
+void OutputDriverPdf::WriteStreamObject(int objno, const std::string& data)
+{
+    OutputSinkString stream;
+    bool compressed = encoder.Begin();
+    encoder.Write(stream, data.data(), data.size(), true);
+    const std::string& streamdata = stream.GetString();
+
+    xref.push_back(PdfXrefItem(GetOffset(), 0, 'n'));
+    m_output << objno << " 0 obj<</Length " << streamdata.size();
+    if (compressed)
+        m_output << (settings.ascii85 ? " /Filter [/ASCII85Decode /FlateDecode]" : " /Filter /FlateDecode");
+    m_output << ">>stream\n" << streamdata << "\nendstream\nendobj\n";
+}
+
+void OutputDriverPdf::WriteGlyphFonts(std::string& resources)
+{
+    if (glyphfonts.empty())  // No characters printed, no fonts and no character map
+        return;
+
+    char buffer[80];
+
+    // One character map for all the fonts, as the codes are the glyph indices in the ROM
+    int objnotounicode = (int)xref.size();
+    std::string cmap;
+    cmap.append("/CIDInit /ProcSet findresource begin 12 dict begin begincmap\n"
+                "/CIDSystemInfo << /Registry (Adobe) /Ordering (UCS) /Supplement 0 >> def\n"
+                "/CMapName /Adobe-Identity-UCS def /CMapType 2 def\n"
+                "1 begincodespacerange <00> <FF> endcodespacerange\n");
+    std::vector<int> codes;
+    for (int code = 0; code < 256; code++)
+    {
+        unsigned short unicode = FontRomGlyph(code)->ansi;
+        if (unicode >= 32 && unicode != 127)
+            codes.push_back(code);
+    }
+    for (size_t i = 0; i < codes.size(); i += 100)  // At most 100 entries in a block
+    {
+        size_t count = codes.size() - i < 100 ? codes.size() - i : 100;
+        sprintf_s(buffer, sizeof(buffer), "%d beginbfchar\n", (int)count);
+        cmap.append(buffer);
+        for (size_t j = i; j < i + count; j++)
+        {
+            sprintf_s(buffer, sizeof(buffer), "<%02X> <%04X>\n", codes[j], FontRomGlyph(codes[j])->ansi);
+            cmap.append(buffer);
+        }
+        cmap.append("endbfchar\n");
+    }
+    cmap.append("endcmap CMapName currentdict /CMap defineresource pop end end\n");
+    WriteStreamObject(objnotounicode, cmap);
+
+    // Every font: font, glyph procedures dictionary, glyph procedures.
+    // Glyph space units are 1/720 inch, y going down as for the interpreter;
+    // the glyphs are made of the same strikes as WriteStrike does.
+    resources.append(" /Font <<");
+    std::vector<EscGlyphDot> dots;
+    for (std::map<unsigned int, GlyphFont>::const_iterator it = glyphfonts.begin(); it != glyphfonts.end(); ++it)
+    {
+        const EscGlyphStyle& style = it->second.style;
+        const std::bitset<256>& used = it->second.used;
+        int objnofont = (int)xref.size();
+        int objnoprocs = objnofont + 1;
+        sprintf_s(buffer, sizeof(buffer), " /G%X %d 0 R", it->first, objnofont);
+        resources.append(buffer);
+
+        int first = 0, last = 255;
+        while (!used.test(first)) first++;
+        while (!used.test(last)) last--;
+        float r = style.GetStrikeRadius();
+        float step = float(style.pitch) / 11.0f;
+
+        xref.push_back(PdfXrefItem(GetOffset(), 0, 'n'));
+        m_output << objnofont << " 0 obj<</Type /Font /Subtype /Type3";
+        m_output << " /FontBBox [" << -(int)r - 1 << " " << -(int)r - 1 << " "
+                 << (int)(9.0f * step + r) + 1 << " " << 8 * 12 + (int)r + 2 << "]";
+        m_output << " /FontMatrix [0.1 0 0 -0.1 0 0]";
+        m_output << " /CharProcs " << objnoprocs << " 0 R";
+        m_output << " /Encoding <</Type /Encoding /Differences [";
+        for (int code = first; code <= last; code++)
+        {
+            if (used.test(code))
+                m_output << code << " /g" << code << " ";
+        }
+        m_output << "]>>";
+        m_output << " /FirstChar " << first << " /LastChar " << last << " /Widths [";
+        for (int code = first; code <= last; code++)
+            m_output << style.pitch << " ";
+        m_output << "]";
+        m_output << " /ToUnicode " << objnotounicode << " 0 R";
+        m_output << " /Resources <<>>>>\n";
+        m_output << "endobj\n";
+
+        xref.push_back(PdfXrefItem(GetOffset(), 0, 'n'));
+        m_output << objnoprocs << " 0 obj<<";
+        int objnoproc = objnoprocs + 1;
+        for (int code = first; code <= last; code++)
+        {
+            if (used.test(code))
+                m_output << "/g" << code << " " << objnoproc++ << " 0 R ";
+        }
+        m_output << ">>\n";
+        m_output << "endobj\n";
+
+        objnoproc = objnoprocs + 1;
+        for (int code = first; code <= last; code++)
+        {
+            if (!used.test(code))
+                continue;
+
+            GetGlyphDots(FontRomGlyph(code), style, dots);
+            sprintf_s(buffer, sizeof(buffer), "%d 0 d0", style.pitch);
+            std::string proc(buffer);
+            if (!dots.empty())
+            {
+                sprintf_s(buffer, sizeof(buffer), " 1 J %g w", r * 2.0f);  // Round cap, pin diameter
+                proc.append(buffer);
+                for (size_t i = 0; i < dots.size(); i++)
+                {
+                    sprintf_s(buffer, sizeof(buffer), " %g %g m %g %g l", dots[i].x, dots[i].y, dots[i].x, dots[i].y);
+                    proc.append(buffer);
+                    if (style.doublestrike)
+                    {
+                        float y = dots[i].y + EscDoubleStrikeShift;
+                        sprintf_s(buffer, sizeof(buffer), " %g %g m %g %g l", dots[i].x, y, dots[i].x, y);
+                        proc.append(buffer);
+                    }
+                }
+                proc.append(" S");
+            }
+            WriteStreamObject(objnoproc++, proc);
+        }
+    }
+    resources.append(" >>");
+}
+
+void OutputDriverPdf::WriteGraphicsImages(std::string& resources)
+{
+    if (images.empty())
+        return;
+
+    char buffer[80];
+    resources.append(" /XObject <<");
+    for (size_t i = 0; i < images.size(); i++)
+    {
+        const GraphicsImage& image = images[i];
+        int objno = (int)xref.size();
+        sprintf_s(buffer, sizeof(buffer), " /Im%d_%d %d 0 R", image.pageno, image.index, objno);
+        resources.append(buffer);
+
+        xref.push_back(PdfXrefItem(GetOffset(), 0, 'n'));
+        m_output << objno << " 0 obj<</Type /XObject /Subtype /Image /Width " << image.width << " /Height " << image.height;
+        m_output << " /ImageMask true /Decode [1 0] /Length " << image.data.size();
+        m_output << (settings.ascii85 ? " /Filter [/ASCII85Decode /FlateDecode]" : " /Filter /FlateDecode");
+        m_output << ">>stream\n" << image.data << "\nendstream\nendobj\n";
+    }
+    resources.append(" >>");
+}
+
+//////////////////////////////////////////////////////////////////////
+// ASCII85 encoding for PDF
+
+typedef unsigned int  uint32_t;
+// make sure uint32_t is 32-bit
+typedef char Z85_uint32_t_static_assert[(sizeof(uint32_t) * 8 == 32) * 2 - 1];
+
+#define DIV85_MAGIC 3233857729ULL
+// make sure magic constant is 64-bit
+typedef char Z85_div85_magic_static_assert[(sizeof(DIV85_MAGIC) * 8 == 64) * 2 - 1];
 
 #define DIV85(number) ((uint32_t)((DIV85_MAGIC * (number)) >> 32) >> 6)
 
@@ -454,7 +1380,7 @@ void ascii85_encode_tuple(const unsigned char* src, char* dst)
     if (value == 0)  // Special case for zero
     {
         dst[0] = 'z';
-        dst[2] = dst[3] = dst[4] = dst[5] = 0;
+        dst[1] = dst[2] = dst[3] = dst[4] = dst[5] = 0;
     }
     else
     {
@@ -468,3 +1394,893 @@ void ascii85_encode_tuple(const unsigned char* src, char* dst)
 }
 
 //////////////////////////////////////////////////////////////////////
+// CCITT Group 4 encoder
+
+// Code of the Group 4 (ITU-T T.6) coding, the bits are the low length bits of the code
+struct G4Code
+{
+    unsigned short code;
+    unsigned char  length;
+};
+
+// Run length codes: the terminating codes for 0..63, then the makeup codes for 64, 128, .. 2560
+static const G4Code G4WhiteCodes[104] =
+{
+    { 0x035,  8 }, { 0x007,  6 }, { 0x007,  4 }, { 0x008,  4 }, { 0x00b,  4 }, { 0x00c,  4 },
+    { 0x00e,  4 }, { 0x00f,  4 }, { 0x013,  5 }, { 0x014,  5 }, { 0x007,  5 }, { 0x008,  5 },
+    { 0x008,  6 }, { 0x003,  6 }, { 0x034,  6 }, { 0x035,  6 }, { 0x02a,  6 }, { 0x02b,  6 },
+    { 0x027,  7 }, { 0x00c,  7 }, { 0x008,  7 }, { 0x017,  7 }, { 0x003,  7 }, { 0x004,  7 },
+    { 0x028,  7 }, { 0x02b,  7 }, { 0x013,  7 }, { 0x024,  7 }, { 0x018,  7 }, { 0x002,  8 },
+    { 0x003,  8 }, { 0x01a,  8 }, { 0x01b,  8 }, { 0x012,  8 }, { 0x013,  8 }, { 0x014,  8 },
+    { 0x015,  8 }, { 0x016,  8 }, { 0x017,  8 }, { 0x028,  8 }, { 0x029,  8 }, { 0x02a,  8 },
+    { 0x02b,  8 }, { 0x02c,  8 }, { 0x02d,  8 }, { 0x004,  8 }, { 0x005,  8 }, { 0x00a,  8 },
+    { 0x00b,  8 }, { 0x052,  8 }, { 0x053,  8 }, { 0x054,  8 }, { 0x055,  8 }, { 0x024,  8 },
+    { 0x025,  8 }, { 0x058,  8 }, { 0x059,  8 }, { 0x05a,  8 }, { 0x05b,  8 }, { 0x04a,  8 },
+    { 0x04b,  8 }, { 0x032,  8 }, { 0x033,  8 }, { 0x034,  8 }, { 0x01b,  5 }, { 0x012,  5 },
+    { 0x017,  6 }, { 0x037,  7 }, { 0x036,  8 }, { 0x037,  8 }, { 0x064,  8 }, { 0x065,  8 },
+    { 0x068,  8 }, { 0x067,  8 }, { 0x0cc,  9 }, { 0x0cd,  9 }, { 0x0d2,  9 }, { 0x0d3,  9 },
+    { 0x0d4,  9 }, { 0x0d5,  9 }, { 0x0d6,  9 }, { 0x0d7,  9 }, { 0x0d8,  9 }, { 0x0d9,  9 },
+    { 0x0da,  9 }, { 0x0db,  9 }, { 0x098,  9 }, { 0x099,  9 }, { 0x09a,  9 }, { 0x018,  6 },
+    { 0x09b,  9 }, { 0x008, 11 }, { 0x00c, 11 }, { 0x00d, 11 }, { 0x012, 12 }, { 0x013, 12 },
+    { 0x014, 12 }, { 0x015, 12 }, { 0x016, 12 }, { 0x017, 12 }, { 0x01c, 12 }, { 0x01d, 12 },
+    { 0x01e, 12 }, { 0x01f, 12 }
+};
+static const G4Code G4BlackCodes[104] =
+{
+    { 0x037, 10 }, { 0x002,  3 }, { 0x003,  2 }, { 0x002,  2 }, { 0x003,  3 }, { 0x003,  4 },
+    { 0x002,  4 }, { 0x003,  5 }, { 0x005,  6 }, { 0x004,  6 }, { 0x004,  7 }, { 0x005,  7 },
+    { 0x007,  7 }, { 0x004,  8 }, { 0x007,  8 }, { 0x018,  9 }, { 0x017, 10 }, { 0x018, 10 },
+    { 0x008, 10 }, { 0x067, 11 }, { 0x068, 11 }, { 0x06c, 11 }, { 0x037, 11 }, { 0x028, 11 },
+    { 0x017, 11 }, { 0x018, 11 }, { 0x0ca, 12 }, { 0x0cb, 12 }, { 0x0cc, 12 }, { 0x0cd, 12 },
+    { 0x068, 12 }, { 0x069, 12 }, { 0x06a, 12 }, { 0x06b, 12 }, { 0x0d2, 12 }, { 0x0d3, 12 },
+    { 0x0d4, 12 }, { 0x0d5, 12 }, { 0x0d6, 12 }, { 0x0d7, 12 }, { 0x06c, 12 }, { 0x06d, 12 },
+    { 0x0da, 12 }, { 0x0db, 12 }, { 0x054, 12 }, { 0x055, 12 }, { 0x056, 12 }, { 0x057, 12 },
+    { 0x064, 12 }, { 0x065, 12 }, { 0x052, 12 }, { 0x053, 12 }, { 0x024, 12 }, { 0x037, 12 },
+    { 0x038, 12 }, { 0x027, 12 }, { 0x028, 12 }, { 0x058, 12 }, { 0x059, 12 }, { 0x02b, 12 },
+    { 0x02c, 12 }, { 0x05a, 12 }, { 0x066, 12 }, { 0x067, 12 }, { 0x00f, 10 }, { 0x0c8, 12 },
+    { 0x0c9, 12 }, { 0x05b, 12 }, { 0x033, 12 }, { 0x034, 12 }, { 0x035, 12 }, { 0x06c, 13 },
+    { 0x06d, 13 }, { 0x04a, 13 }, { 0x04b, 13 }, { 0x04c, 13 }, { 0x04d, 13 }, { 0x072, 13 },
+    { 0x073, 13 }, { 0x074, 13 }, { 0x075, 13 }, { 0x076, 13 }, { 0x077, 13 }, { 0x052, 13 },
+    { 0x053, 13 }, { 0x054, 13 }, { 0x055, 13 }, { 0x05a, 13 }, { 0x05b, 13 }, { 0x064, 13 },
+    { 0x065, 13 }, { 0x008, 11 }, { 0x00c, 11 }, { 0x00d, 11 }, { 0x012, 12 }, { 0x013, 12 },
+    { 0x014, 12 }, { 0x015, 12 }, { 0x016, 12 }, { 0x017, 12 }, { 0x01c, 12 }, { 0x01d, 12 },
+    { 0x01e, 12 }, { 0x01f, 12 }
+};
+
+static const G4Code G4PassCode = { 0x1, 4 };        // 0001
+static const G4Code G4HorizontalCode = { 0x1, 3 };  // 001
+// Vertical mode codes, by a1 - b1 from -3 to 3: VL3 .. V0 .. VR3
+static const G4Code G4VerticalCodes[7] =
+{
+    { 0x02, 7 }, { 0x02, 6 }, { 0x2, 3 }, { 0x1, 1 }, { 0x3, 3 }, { 0x03, 6 }, { 0x03, 7 }
+};
+static const G4Code G4EndOfLine = { 0x001, 12 };
+
+// Codes the rows one by one, every row against the row above it, the first row against a white row;
+// the rows are the pixels a byte each, 1 for black
+class G4Encoder
+{
+public:
+    G4Encoder(OutputSink& output, int width);
+
+public:
+    void EncodeRow(const unsigned char* row);
+    // Write the end of facsimile block, padded to a byte
+    void End();
+
+private:
+    // Position of the first pixel from x on, up to the row end, of the color other than the given one;
+    // the runs are skipped by 8 pixels at a time
+    int FindChange(const unsigned char* row, int x, unsigned char color) const
+    {
+        const unsigned long long run = color * 0x0101010101010101ULL;
+        while (x + 8 <= m_width)
+        {
+            unsigned long long pixels;
+            memcpy(&pixels, row + x, 8);
+            if (pixels != run)
+                break;
+            x += 8;
+        }
+        while (x < m_width && row[x] == color)
+            x++;
+        return x;
+    }
+    void PutCode(const G4Code& code) { PutBits(code.code, code.length); }
+    void PutBits(unsigned int code, int length);
+    // Put a run, as the makeup codes and the terminating code
+    void PutRun(int run, const G4Code* codes);
+
+private:
+    OutputSink& m_output;
+    int m_width;
+    std::vector<unsigned char> m_refrow;  // Row above the row coded
+    unsigned long m_bits;  // Bits not written yet, in the low m_bitcount bits
+    int m_bitcount;
+};
+
+G4Encoder::G4Encoder(OutputSink& output, int width) :
+    m_output(output), m_width(width), m_refrow(width, 0), m_bits(0), m_bitcount(0)
+{
+}
+
+// a0 is the last changing pixel coded, a1 and a2 are the next changes on the coding row;
+// b1 is the next change on the reference row to the color other than the color of a0, b2 is the change after b1
+void G4Encoder::EncodeRow(const unsigned char* row)
+{
+    const unsigned char* ref = &m_refrow[0];
+    int a0 = 0;
+    int a1 = (row[0] != 0) ? 0 : FindChange(row, 0, 0);
+    int b1 = (ref[0] != 0) ? 0 : FindChange(ref, 0, 0);
+    while (true)
+    {
+        int b2 = (b1 < m_width) ? FindChange(ref, b1, ref[b1]) : m_width;
+        if (b2 < a1)  // Pass mode
+        {
+            PutCode(G4PassCode);
+            a0 = b2;
+        }
+        else if (a1 - b1 >= -3 && a1 - b1 <= 3)  // Vertical mode
+        {
+            PutCode(G4VerticalCodes[a1 - b1 + 3]);
+            a0 = a1;
+        }
+        else  // Horizontal mode: the runs a0..a1 and a1..a2
+        {
+            int a2 = (a1 < m_width) ? FindChange(row, a1, row[a1]) : m_width;
+            PutCode(G4HorizontalCode);
+            if (a0 + a1 == 0 || row[a0] == 0)  // The row starts with white, even if with no white pixels
+            {
+                PutRun(a1 - a0, G4WhiteCodes);
+                PutRun(a2 - a1, G4BlackCodes);
+            }
+            else
+            {
+                PutRun(a1 - a0, G4BlackCodes);
+                PutRun(a2 - a1, G4WhiteCodes);
+            }
+            a0 = a2;
+        }
+        if (a0 >= m_width)
+            break;
+
+        unsigned char color = row[a0];
+        a1 = FindChange(row, a0, color);
+        b1 = FindChange(ref, a0, color ^ 1);
+        b1 = FindChange(ref, b1, color);
+    }
+
+    memcpy(&m_refrow[0], row, m_width);
+}
+
+void G4Encoder::End()
+{
+    PutCode(G4EndOfLine);
+    PutCode(G4EndOfLine);
+    if (m_bitcount > 0)
+        PutBits(0, 8 - m_bitcount);
+}
+
+void G4Encoder::PutBits(unsigned int code, int length)
+{
+    m_bits = (m_bits << length) | code;
+    m_bitcount += length;
+    while (m_bitcount >= 8)
+    {
+        m_bitcount -= 8;
+        m_output << (char)(m_bits >> m_bitcount);
+    }
+    m_bits &= (1UL << m_bitcount) - 1;
+}
+
+void G4Encoder::PutRun(int run, const G4Code* codes)
+{
+    while (run >= 2560 + 64)
+    {
+        PutCode(codes[63 + 2560 / 64]);
+        run -= 2560;
+    }
+    if (run >= 64)
+    {
+        PutCode(codes[63 + run / 64]);
+        run %= 64;
+    }
+    PutCode(codes[run]);
+}
+
+
+//////////////////////////////////////////////////////////////////////
+// Raster driver
+
+// Page size, 1/720 inch: A4, as for PDF
+const int RasterPageSizeX = 5950;
+const int RasterPageSizeY = 8420;
+// Subpixel offsets of the anti-aliased strikes, in x and in y
+const int RasterSubpixels = 4;
+// Samples in x and in y computing the coverage of a pixel
+const int RasterCoverageSamples = 8;
+// Pixel rows of the bands the page is drawn by
+const int RasterBandRows = 128;
+
+static void PutUInt32BE(unsigned char* dst, unsigned long value)
+{
+    dst[0] = (unsigned char)(value >> 24);  dst[1] = (unsigned char)(value >> 16);
+    dst[2] = (unsigned char)(value >> 8);   dst[3] = (unsigned char)value;
+}
+
+// Writes the page image row by row, the rows from the top down;
+// the row pixels are a byte each, 255 for the ink
+class RasterImageWriter
+{
+public:
+    // PNG is 8-bit grayscale when anti-aliased, 1-bit otherwise
+    RasterImageWriter(OutputSink& output, const OutputDriverRasterSettings& settings, int width, int height);
+    ~RasterImageWriter();
+
+public:
+    void WriteRow(const unsigned char* pixels);
+    // Complete the image, after the last row
+    void End();
+
+private:
+    void WritePngChunk(const char* type, const unsigned char* data, size_t size);
+    // Deflate the PNG row, writing the IDAT chunks filled
+    void DeflateRow(const unsigned char* data, size_t size, bool finish);
+
+private:
+    OutputSink& m_output;
+    int m_format;
+    int m_width;
+    bool m_gray;
+    std::vector<unsigned char> m_row;  // Row in the image format
+    z_stream m_zstrm;  // PNG image data deflate state
+    bool m_zopen;
+    std::vector<unsigned char> m_zbuffer;  // Data of the IDAT chunk being filled
+    G4Encoder* m_g4;  // TIFF strip encoder
+
+private:
+    RasterImageWriter(const RasterImageWriter&);
+    RasterImageWriter& operator=(const RasterImageWriter&);
+};
+
+RasterImageWriter::RasterImageWriter(OutputSink& output, const OutputDriverRasterSettings& settings, int width, int height) :
+    m_output(output), m_format(settings.format), m_width(width), m_zopen(false), m_g4(0)
+{
+    int format = settings.format;
+    bool gray = settings.antialias;  // PNG bit depth
+    m_gray = (format == RASTER_FORMAT_PGM || (format == RASTER_FORMAT_PNG && gray));
+
+    if (format == RASTER_FORMAT_PBM)
+    {
+        m_row.resize((width + 7) / 8);
+        m_output << "P4\n" << width << " " << height << "\n";
+    }
+    else if (format == RASTER_FORMAT_TIFF)  // The strip data only, see OutputDriverTiff
+    {
+        m_row.resize(width);
+        m_g4 = new G4Encoder(output, width);
+    }
+    else if (format == RASTER_FORMAT_PGM)
+    {
+        m_row.resize(width);
+        m_output << "P5\n" << width << " " << height << "\n255\n";
+    }
+    else  // PNG, 1-bit or 8-bit grayscale
+    {
+        m_row.resize(1 + (gray ? width : (width + 7) / 8));  // Filter type byte, then the pixels
+
+        static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+        m_output.Write((const char*)signature, sizeof(signature));
+
+        unsigned char header[13];
+        PutUInt32BE(header, width);
+        PutUInt32BE(header + 4, height);
+        header[8] = gray ? 8 : 1;  // Bit depth
+        header[9] = 0;   // Grayscale
+        header[10] = 0;  // Deflate
+        header[11] = 0;  // Adaptive filtering
+        header[12] = 0;  // No interlace
+        WritePngChunk("IHDR", header, sizeof(header));
+
+        unsigned char physical[9];
+        unsigned long ppm = (unsigned long)(settings.dpi / 0.0254 + 0.5);  // Pixels per meter
+        PutUInt32BE(physical, ppm);
+        PutUInt32BE(physical + 4, ppm);
+        physical[8] = 1;  // The unit is meter
+        WritePngChunk("pHYs", physical, sizeof(physical));
+
+        memset(&m_zstrm, 0, sizeof(m_zstrm));
+        m_zopen = (deflateInit(&m_zstrm, settings.zlevel) == Z_OK);
+        m_zbuffer.resize(64 * 1024);
+        m_zstrm.next_out = &m_zbuffer[0];
+        m_zstrm.avail_out = (uInt)m_zbuffer.size();
+    }
+}
+
+RasterImageWriter::~RasterImageWriter()
+{
+    if (m_zopen)
+        deflateEnd(&m_zstrm);
+    delete m_g4;
+}
+
+void RasterImageWriter::WriteRow(const unsigned char* pixels)
+{
+    if (m_gray)
+    {
+        unsigned char* dst = &m_row[0];
+        if (m_format == RASTER_FORMAT_PNG)
+            *dst++ = 0;  // No filter
+        for (int x = 0; x < m_width; x++)
+            dst[x] = (unsigned char)(255 - pixels[x]);
+        if (m_format == RASTER_FORMAT_PGM)
+            m_output.Write((const char*)&m_row[0], m_row.size());
+        else
+            DeflateRow(&m_row[0], m_row.size(), false);
+        return;
+    }
+
+    if (m_g4 != 0)
+    {
+        for (int x = 0; x < m_width; x++)
+            m_row[x] = (pixels[x] >= 128) ? 1 : 0;
+        m_g4->EncodeRow(&m_row[0]);
+        return;
+    }
+
+    // Pack the pixels, PBM has 1 for black and PNG has 1 for white
+    unsigned char* dst = &m_row[0];
+    if (m_format == RASTER_FORMAT_PNG)
+        *dst++ = 0;  // No filter
+    unsigned char invert = (m_format == RASTER_FORMAT_PNG) ? 0xff : 0;
+    for (int x = 0; x < m_width; x += 8)
+    {
+        unsigned char bits = 0;
+        for (int i = 0; i < 8 && x + i < m_width; i++)
+        {
+            if (pixels[x + i] >= 128)
+                bits |= 0x80 >> i;
+        }
+        *dst++ = bits ^ invert;
+    }
+    if (m_format == RASTER_FORMAT_PNG && (m_width & 7) != 0)
+        dst[-1] &= (unsigned char)(0xff00 >> (m_width & 7));  // Padding bits are zero
+
+    if (m_format == RASTER_FORMAT_PBM)
+        m_output.Write((const char*)&m_row[0], m_row.size());
+    else
+        DeflateRow(&m_row[0], m_row.size(), false);
+}
+
+void RasterImageWriter::End()
+{
+    if (m_g4 != 0)
+        m_g4->End();
+    if (m_format != RASTER_FORMAT_PNG)
+        return;
+
+    DeflateRow(0, 0, true);
+    WritePngChunk("IEND", 0, 0);
+}
+
+void RasterImageWriter::DeflateRow(const unsigned char* data, size_t size, bool finish)
+{
+    if (!m_zopen)
+        return;
+
+    m_zstrm.next_in = (Bytef*)data;
+    m_zstrm.avail_in = (uInt)size;
+    while (true)
+    {
+        int result = deflate(&m_zstrm, finish ? Z_FINISH : Z_NO_FLUSH);
+        if (m_zstrm.avail_out == 0 || (finish && result == Z_STREAM_END))
+        {
+            WritePngChunk("IDAT", &m_zbuffer[0], m_zbuffer.size() - m_zstrm.avail_out);
+            m_zstrm.next_out = &m_zbuffer[0];
+            m_zstrm.avail_out = (uInt)m_zbuffer.size();
+        }
+        if (finish ? result == Z_STREAM_END || result != Z_OK : m_zstrm.avail_in == 0)
+            break;
+    }
+}
+
+void RasterImageWriter::WritePngChunk(const char* type, const unsigned char* data, size_t size)
+{
+    unsigned char buffer[8];
+    PutUInt32BE(buffer, (unsigned long)size);
+    memcpy(buffer + 4, type, 4);
+    m_output.Write((const char*)buffer, 8);
+    if (size > 0)
+        m_output.Write((const char*)data, size);
+
+    unsigned long crc = crc32(0L, buffer + 4, 4);
+    if (size > 0)
+        crc = crc32(crc, data, (uInt)size);
+    PutUInt32BE(buffer, crc);
+    m_output.Write((const char*)buffer, 4);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Raster band drawing threads
+
+// Draws the bands of a page on worker threads, while the bands drawn are written in order;
+// the bands drawn and not written yet are kept in a window of band slots
+class RasterBandPool
+{
+public:
+    RasterBandPool(int threads);
+    ~RasterBandPool();
+
+public:
+    // Number of band slots, the band n is drawn in the slot n % window
+    int GetWindow() const { return m_window; }
+    // Start drawing the bands 0..count-1 of the page, draw(band, slot) runs on the workers
+    void Start(int count, const std::function<void(int, int)>& draw);
+    // Wait until the band is drawn; the bands are waited for in order
+    void Wait(int band);
+    // The band is written, its slot is free for a next band
+    void Release(int band);
+
+private:
+    void WorkerProc();
+
+private:
+    std::vector<std::thread> m_workers;
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::function<void(int, int)> m_draw;
+    int m_window;
+    int m_count;     // Bands of the page
+    int m_next;      // Next band to draw
+    int m_released;  // Bands written
+    std::vector<char> m_done;  // Is the band drawn, by the band
+    bool m_stop;
+};
+
+RasterBandPool::RasterBandPool(int threads) :
+    m_window(threads * 2), m_count(0), m_next(0), m_released(0), m_stop(false)
+{
+    for (int i = 0; i < threads; i++)
+        m_workers.push_back(std::thread(&RasterBandPool::WorkerProc, this));
+}
+
+RasterBandPool::~RasterBandPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+        m_cond.notify_all();
+    }
+    for (size_t i = 0; i < m_workers.size(); i++)
+        m_workers[i].join();
+}
+
+void RasterBandPool::Start(int count, const std::function<void(int, int)>& draw)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_draw = draw;
+    m_count = count;
+    m_next = m_released = 0;
+    m_done.assign(count, 0);
+    m_cond.notify_all();
+}
+
+void RasterBandPool::Wait(int band)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cond.wait(lock, [&]() { return m_done[band] != 0; });
+}
+
+void RasterBandPool::Release(int band)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_released = band + 1;
+    m_cond.notify_all();
+}
+
+void RasterBandPool::WorkerProc()
+{
+    while (true)
+    {
+        int band;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cond.wait(lock, [&]() { return m_stop || (m_next < m_count && m_next < m_released + m_window); });
+            if (m_stop)
+                return;
+            band = m_next++;
+        }
+
+        m_draw(band, band % m_window);
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_done[band] = 1;
+        m_cond.notify_all();
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////
+
+OutputDriverRaster::OutputDriverRaster(OutputSink& output, const OutputDriverRasterSettings& asettings) :
+    OutputDriver(output), settings(asettings), bandpool(0)
+{
+    scale = settings.dpi / 720.0f;
+    width = (int)(RasterPageSizeX * scale + 0.5f);
+    height = (int)(RasterPageSizeY * scale + 0.5f);
+
+    bandstrikes.resize((height + RasterBandRows - 1) / RasterBandRows);
+    if (settings.threads > 0)
+        bandpool = new RasterBandPool(settings.threads);
+    bands.resize(bandpool != 0 ? bandpool->GetWindow() : 1);
+
+    BuildStamp(EscStrikeRadius, stamp);
+    BuildStamp(EscStrikeRadiusBold, stampbold);
+    if (settings.antialias)
+    {
+        BuildCoverage(EscStrikeRadius, coverage);
+        BuildCoverage(EscStrikeRadiusBold, coveragebold);
+    }
+}
+
+OutputDriverRaster::~OutputDriverRaster()
+{
+    delete bandpool;
+}
+
+// The strike covers the pixels with the center within the radius from the center
+// of the pixel the strike center falls in
+void OutputDriverRaster::BuildStamp(float r, DotStamp& stamp) const
+{
+    float pr = r * scale;  // Radius in pixels
+    int rows = (int)pr;
+    stamp.top = -rows;
+    stamp.runs.clear();
+    for (int dy = -rows; dy <= rows; dy++)
+    {
+        int dx = (int)sqrtf(pr * pr - (float)(dy * dy));
+        stamp.runs.push_back(-dx);
+        stamp.runs.push_back(dx + 1);
+    }
+}
+
+void OutputDriverRaster::DrawStamp(const DotStamp& stamp, float x, float y, RasterBand& band) const
+{
+    int cx = (int)floorf(x * scale);
+    int cy = (int)floorf(y * scale);
+    int rowcount = (int)stamp.runs.size() / 2;
+    for (int i = 0; i < rowcount; i++)
+    {
+        int py = cy + stamp.top + i - band.top;
+        if (py < 0 || py >= band.height)
+            continue;
+        int left = cx + stamp.runs[i * 2];
+        int right = cx + stamp.runs[i * 2 + 1];
+        if (left < 0) left = 0;
+        if (right > width) right = width;
+        if (left < right)
+            memset(&band.bitmap[(size_t)py * width + left], 255, right - left);
+    }
+}
+
+// The masks are sampled at RasterCoverageSamples^2 points a pixel; the subpixel offset
+// is the strike center position in the pixel, rounded to a RasterSubpixels grid
+void OutputDriverRaster::BuildCoverage(float r, DotCoverage& coverage) const
+{
+    float pr = r * scale;  // Radius in pixels
+    int reach = (int)ceilf(pr) + 1;  // Pixels from the center pixel to the mask edge
+    coverage.left = coverage.top = -reach;
+    coverage.width = coverage.rows = reach * 2 + 1;
+    coverage.rowbytes = (coverage.width + 15) & ~15;
+    size_t masksize = (size_t)coverage.rows * coverage.rowbytes;
+    coverage.masks.assign(masksize * RasterSubpixels * RasterSubpixels, 0);
+
+    for (int suby = 0; suby < RasterSubpixels; suby++)
+    {
+        for (int subx = 0; subx < RasterSubpixels; subx++)
+        {
+            unsigned char* mask = &coverage.masks[(suby * RasterSubpixels + subx) * masksize];
+            float cx = reach + (subx + 0.5f) / RasterSubpixels;  // Center, pixels from the mask left
+            float cy = reach + (suby + 0.5f) / RasterSubpixels;
+            for (int row = 0; row < coverage.rows; row++)
+            {
+                for (int col = 0; col < coverage.width; col++)
+                {
+                    int inside = 0;
+                    for (int sy = 0; sy < RasterCoverageSamples; sy++)
+                    {
+                        float dy = row + (sy + 0.5f) / RasterCoverageSamples - cy;
+                        for (int sx = 0; sx < RasterCoverageSamples; sx++)
+                        {
+                            float dx = col + (sx + 0.5f) / RasterCoverageSamples - cx;
+                            if (dx * dx + dy * dy <= pr * pr)
+                                inside++;
+                        }
+                    }
+                    const int samples = RasterCoverageSamples * RasterCoverageSamples;
+                    mask[row * coverage.rowbytes + col] = (unsigned char)((inside * 255 + samples / 2) / samples);
+                }
+            }
+        }
+    }
+}
+
+// Add the ink to the pixels, saturating; size is a multiple of 16
+static inline void AddInk(unsigned char* dst, const unsigned char* src, int size)
+{
+#ifdef RASTER_SSE2
+    for (int i = 0; i < size; i += 16)
+    {
+        __m128i pixels = _mm_loadu_si128((const __m128i*)(dst + i));
+        __m128i ink = _mm_loadu_si128((const __m128i*)(src + i));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_adds_epu8(pixels, ink));
+    }
+#else
+    for (int i = 0; i < size; i++)
+    {
+        int value = dst[i] + src[i];
+        dst[i] = (unsigned char)(value > 255 ? 255 : value);
+    }
+#endif
+}
+
+// The overlapping strikes add up their ink
+void OutputDriverRaster::DrawCoverage(const DotCoverage& coverage, float x, float y, RasterBand& band) const
+{
+    float px = x * scale;
+    float py = y * scale;
+    int cx = (int)floorf(px);
+    int cy = (int)floorf(py);
+    int subx = (int)((px - cx) * RasterSubpixels);
+    int suby = (int)((py - cy) * RasterSubpixels);
+    size_t masksize = (size_t)coverage.rows * coverage.rowbytes;
+    const unsigned char* mask = &coverage.masks[(suby * RasterSubpixels + subx) * masksize];
+
+    int left = cx + coverage.left;
+    bool inside = (left >= 0 && left + coverage.rowbytes <= width);  // The padded rows fit in the page rows
+    for (int row = 0; row < coverage.rows; row++, mask += coverage.rowbytes)
+    {
+        int pixely = cy + coverage.top + row - band.top;
+        if (pixely < 0 || pixely >= band.height)
+            continue;
+        unsigned char* dst = &band.bitmap[(size_t)pixely * width];
+        if (inside)  // The padding adds nothing to the pixels after the mask
+        {
+            AddInk(dst + left, mask, coverage.rowbytes);
+            continue;
+        }
+        for (int col = 0; col < coverage.width; col++)
+        {
+            if (left + col < 0 || left + col >= width)
+                continue;
+            int value = dst[left + col] + mask[col];
+            dst[left + col] = (unsigned char)(value > 255 ? 255 : value);
+        }
+    }
+}
+
+void OutputDriverRaster::WritePageBeginning(int /*pageno*/)
+{
+    for (size_t band = 0; band < bandstrikes.size(); band++)
+        bandstrikes[band].clear();
+}
+
+void OutputDriverRaster::WritePageEnding()
+{
+    DrawPage(m_output);
+}
+
+// Every band is drawn from its strikes, written and dropped, so one band bitmap is kept at a time;
+// with the drawing threads, a window of bands is drawn ahead of the band being written
+void OutputDriverRaster::DrawPage(OutputSink& output)
+{
+    RasterImageWriter writer(output, settings, width, height);
+    int count = (int)bandstrikes.size();
+    if (bandpool != 0)
+        bandpool->Start(count, [this](int index, int slot) { DrawBand(index, bands[slot]); });
+    for (int index = 0; index < count; index++)
+    {
+        RasterBand& band = bands[index % bands.size()];
+        if (bandpool != 0)
+            bandpool->Wait(index);
+        else
+            DrawBand(index, band);
+
+        for (int y = 0; y < band.height; y++)
+            writer.WriteRow(&band.bitmap[(size_t)y * width]);
+
+        if (bandpool != 0)
+            bandpool->Release(index);
+    }
+    writer.End();
+}
+
+void OutputDriverRaster::DrawBand(int index, RasterBand& band) const
+{
+    band.top = index * RasterBandRows;
+    band.height = (height - band.top < RasterBandRows) ? height - band.top : RasterBandRows;
+    band.bitmap.assign((size_t)width * band.height, 0);
+
+    const std::vector<BandStrike>& strikes = bandstrikes[index];
+    for (size_t i = 0; i < strikes.size(); i++)
+        DrawStrike(strikes[i], band);
+}
+
+// The strike goes to every band its pixels may reach, see BuildStamp and BuildCoverage
+// The strikes are bucketed right in the expansion loops, not through the virtual WriteStrike
+void OutputDriverRaster::WriteGlyph(const glyph* gl, int x, int y, const EscGlyphStyle& style)
+{
+    ExpandGlyph([this](float sx, float sy, float r) { OutputDriverRaster::WriteStrike(sx, sy, r); },
+                GetGlyphStrikes(gl, style), x, y, style);
+}
+
+void OutputDriverRaster::WriteGraphics(const EscGraphics& graphics, int x, int y)
+{
+    ExpandGraphics([this](float sx, float sy, float r) { OutputDriverRaster::WriteStrike(sx, sy, r); },
+                   graphics, x, y);
+}
+
+void OutputDriverRaster::WriteStrike(float x, float y, float r)
+{
+    int cy = (int)floorf(y * scale);
+    int reach = (int)ceilf(r * scale) + 1;
+    int top = cy - reach;
+    int bottom = cy + reach;
+    if (top < 0) top = 0;
+    if (bottom > height - 1) bottom = height - 1;
+    if (top > bottom)
+        return;
+
+    BandStrike strike;
+    strike.x = x;  strike.y = y;  strike.r = r;
+    for (int band = top / RasterBandRows; band <= bottom / RasterBandRows; band++)
+        bandstrikes[band].push_back(strike);
+}
+
+void OutputDriverRaster::DrawStrike(const BandStrike& strike, RasterBand& band) const
+{
+    float x = strike.x, y = strike.y, r = strike.r;
+    if (settings.antialias)
+    {
+        if (r == EscStrikeRadius)
+            DrawCoverage(coverage, x, y, band);
+        else if (r == EscStrikeRadiusBold)
+            DrawCoverage(coveragebold, x, y, band);
+        else
+        {
+            DotCoverage coverageother;
+            BuildCoverage(r, coverageother);
+            DrawCoverage(coverageother, x, y, band);
+        }
+        return;
+    }
+
+    if (r == EscStrikeRadius)
+        DrawStamp(stamp, x, y, band);
+    else if (r == EscStrikeRadiusBold)
+        DrawStamp(stampbold, x, y, band);
+    else
+    {
+        DotStamp stampother;
+        BuildStamp(r, stampother);
+        DrawStamp(stampother, x, y, band);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+// TIFF driver
+
+// Tags of the page directory, see WritePendingPage
+const int TiffPageTags = 14;
+// Directories must start on a word boundary: the header, the page directory with its resolution values
+// and the padded strip all have even sizes
+typedef char TiffPageDirectory_even_static_assert[((2 + TiffPageTags * 12 + 4 + 16) % 2 == 0) * 2 - 1];
+
+static void PutUInt16LE(unsigned char* dst, unsigned int value)
+{
+    dst[0] = (unsigned char)value;  dst[1] = (unsigned char)(value >> 8);
+}
+static void PutUInt32LE(unsigned char* dst, unsigned long value)
+{
+    dst[0] = (unsigned char)value;          dst[1] = (unsigned char)(value >> 8);
+    dst[2] = (unsigned char)(value >> 16);  dst[3] = (unsigned char)(value >> 24);
+}
+
+// Directory entry of a single SHORT (type 3) or LONG (type 4) value
+static unsigned char* PutTiffTag(unsigned char* dst, unsigned int tag, unsigned int type, unsigned long value)
+{
+    PutUInt16LE(dst, tag);
+    PutUInt16LE(dst + 2, type);
+    PutUInt32LE(dst + 4, 1);
+    PutUInt32LE(dst + 8, 0);
+    if (type == 3)
+        PutUInt16LE(dst + 8, (unsigned int)value);
+    else
+        PutUInt32LE(dst + 8, value);
+    return dst + 12;
+}
+
+OutputDriverTiff::OutputDriverTiff(OutputSink& output, const OutputDriverRasterSettings& settings) :
+    OutputDriverRaster(output, settings), docstart(0), pagepending(false)
+{
+}
+
+void OutputDriverTiff::WriteBeginning()
+{
+    docstart = m_output.Tell();
+
+    // Little-endian; the first page directory follows the header
+    static const unsigned char header[8] = { 'I', 'I', 42, 0, 8, 0, 0, 0 };
+    m_output.Write((const char*)header, sizeof(header));
+}
+
+void OutputDriverTiff::WriteEnding(int /*pagestotal*/)
+{
+    if (pagepending)
+        WritePendingPage(true);
+}
+
+// The page is coded row by row as the bands are drawn; the Group 4 data is kept until the next page
+void OutputDriverTiff::WritePageEnding()
+{
+    if (pagepending)
+        WritePendingPage(false);
+
+    OutputSinkString strip;
+    DrawPage(strip);
+    pagestrip.swap(strip.GetString());
+    pagepending = true;
+}
+
+// The page drivers keep their page, nothing is written to pagedata
+void OutputDriverTiff::AppendPage(const OutputDriver& pagedriver, const std::string& /*pagedata*/)
+{
+    const OutputDriverTiff& tiffpagedriver = static_cast<const OutputDriverTiff&>(pagedriver);
+
+    if (pagepending)
+        WritePendingPage(false);
+    pagestrip = tiffpagedriver.pagestrip;
+    pagepending = true;
+}
+
+// The page is its directory, the resolution values, then the strip data padded to an even length;
+// the next page directory, if any, follows the strip
+void OutputDriverTiff::WritePendingPage(bool last)
+{
+    unsigned long offset = (unsigned long)(m_output.Tell() - docstart);
+    const size_t dirsize = 2 + TiffPageTags * 12 + 4;
+    unsigned long resolution = (unsigned long)(offset + dirsize);  // Two RATIONALs: x and y
+    unsigned long stripoffset = resolution + 16;
+    size_t striplength = pagestrip.size();
+    if (striplength & 1)
+        pagestrip.push_back(0);
+    unsigned long next = last ? 0 : (unsigned long)(stripoffset + pagestrip.size());
+
+    unsigned char page[dirsize + 16];
+    unsigned char* dst = page;
+    PutUInt16LE(dst, TiffPageTags);  dst += 2;
+    dst = PutTiffTag(dst, 254, 4, 2);  // NewSubfileType: a page of a multi-page document
+    dst = PutTiffTag(dst, 256, 4, width);  // ImageWidth
+    dst = PutTiffTag(dst, 257, 4, height);  // ImageLength
+    dst = PutTiffTag(dst, 258, 3, 1);  // BitsPerSample
+    dst = PutTiffTag(dst, 259, 3, 4);  // Compression: CCITT Group 4
+    dst = PutTiffTag(dst, 262, 3, 0);  // PhotometricInterpretation: WhiteIsZero
+    dst = PutTiffTag(dst, 273, 4, stripoffset);  // StripOffsets
+    dst = PutTiffTag(dst, 277, 3, 1);  // SamplesPerPixel
+    dst = PutTiffTag(dst, 278, 4, height);  // RowsPerStrip
+    dst = PutTiffTag(dst, 279, 4, (unsigned long)striplength);  // StripByteCounts, without the padding
+    dst = PutTiffTag(dst, 282, 5, resolution);  // XResolution, RATIONAL
+    dst = PutTiffTag(dst, 283, 5, resolution + 8);  // YResolution, RATIONAL
+    dst = PutTiffTag(dst, 293, 4, 0);  // T6Options
+    dst = PutTiffTag(dst, 296, 3, 2);  // ResolutionUnit: inch
+    PutUInt32LE(dst, next);  dst += 4;
+    PutUInt32LE(dst, settings.dpi);  PutUInt32LE(dst + 4, 1);  dst += 8;
+    PutUInt32LE(dst, settings.dpi);  PutUInt32LE(dst + 4, 1);  dst += 8;
+
+    m_output.Write((const char*)page, sizeof(page));
+    m_output.Write(pagestrip.data(), pagestrip.size());
+    std::string().swap(pagestrip);
+    pagepending = false;
+}
+
+//////////////////////////////////////////////////////////////////////
@@ -12,7 +12,14 @@ UKNCBTL. If not, see <http://www.gnu.org/licenses/>. */
 
 #include "ESCParser.h"
 #include <iostream>
-#include <fstream>
+#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "zlib/zlib.h"
 
 
 //////////////////////////////////////////////////////////////////////
@@ -28,7 +35,14 @@ UKNCBTL. If not, see <http://www.gnu.org/licenses/>. */
 
 const char* g_InputFileName = 0;
 int g_OutputDriverType = OUTPUT_DRIVER_POSTSCRIPT;
+OutputSink* g_pOutput = 0;
 OutputDriver* g_pOutputDriver = 0;
+bool g_UsePageIndex = false;
+int g_PageFirst = 1;
+int g_PageLast = 0;  // 0 means up to the last page
+int g_Jobs = 1;
+OutputDriverPdfSettings g_PdfSettings;
+OutputDriverRasterSettings g_RasterSettings;
 
 
 //////////////////////////////////////////////////////////////////////
@@ -36,10 +50,16 @@ OutputDriver* g_pOutputDriver = 0;
 
 bool ParseCommandLine(int argc, char* argv[])
 {
+    // PDF pages are deflated on the cores left from the interpreter, by default
+    int cores = (int)std::thread::hardware_concurrency();
+    g_PdfSettings.zthreads = cores > 1 ? cores - 1 : 0;
+    // The page bands are drawn on all the cores, the interpreter waits for them
+    g_RasterSettings.threads = cores > 1 ? cores : 0;
+
     for (int argn = 1; argn < argc; argn++)
     {
         const char* arg = argv[argn];
-        if (arg[0] == OPTIONCHAR)
+        if (arg[0] == OPTIONCHAR && arg[1] != 0)
         {
             if (_stricmp(arg + 1, "svg") == 0)
                 g_OutputDriverType = OUTPUT_DRIVER_SVG;
@@ -49,6 +69,103 @@ bool ParseCommandLine(int argc, char* argv[])
                 g_OutputDriverType = OUTPUT_DRIVER_PDF;
             else if (_stricmp(arg + 1, "txt") == 0)
                 g_OutputDriverType = OUTPUT_DRIVER_TXT;
+            else if (_stricmp(arg + 1, "pbm") == 0 || _stricmp(arg + 1, "pgm") == 0 || _stricmp(arg + 1, "png") == 0)
+            {
+                g_OutputDriverType = OUTPUT_DRIVER_RASTER;
+                g_RasterSettings.format = (_stricmp(arg + 1, "pbm") == 0) ? RASTER_FORMAT_PBM :
+                        (_stricmp(arg + 1, "pgm") == 0) ? RASTER_FORMAT_PGM : RASTER_FORMAT_PNG;
+            }
+            else if (_stricmp(arg + 1, "tiff") == 0)
+            {
+                g_OutputDriverType = OUTPUT_DRIVER_RASTER;
+                g_RasterSettings.format = RASTER_FORMAT_TIFF;
+            }
+            else if (_stricmp(arg + 1, "aa") == 0)
+                g_RasterSettings.antialias = true;
+            else if (_stricmp(arg + 1, "dpi") == 0 && argn + 1 < argc)
+            {
+                g_RasterSettings.dpi = atoi(argv[++argn]);
+                if (g_RasterSettings.dpi < 1 || g_RasterSettings.dpi > 2400)
+                {
+                    std::cerr << "Wrong resolution: " << argv[argn] << std::endl;
+                    return false;
+                }
+            }
+            else if (_stricmp(arg + 1, "jobs") == 0 && argn + 1 < argc)
+            {
+                g_Jobs = atoi(argv[++argn]);
+                if (g_Jobs == 0)  // All the cores
+                    g_Jobs = (int)std::thread::hardware_concurrency();
+                if (g_Jobs < 1)
+                {
+                    std::cerr << "Wrong number of jobs: " << argv[argn] << std::endl;
+                    return false;
+                }
+            }
+            else if (_stricmp(arg + 1, "ascii85") == 0)
+                g_PdfSettings.ascii85 = true;
+            else if (_stricmp(arg + 1, "zlevel") == 0 && argn + 1 < argc)
+            {
+                g_PdfSettings.zlevel = g_RasterSettings.zlevel = atoi(argv[++argn]);
+                if (g_PdfSettings.zlevel < 0 || g_PdfSettings.zlevel > 9)
+                {
+                    std::cerr << "Wrong compression level: " << argv[argn] << std::endl;
+                    return false;
+                }
+            }
+            else if (_stricmp(arg + 1, "zstrategy") == 0 && argn + 1 < argc)
+            {
+                const char* strategy = argv[++argn];
+                if (_stricmp(strategy, "default") == 0)
+                    g_PdfSettings.zstrategy = Z_DEFAULT_STRATEGY;
+                else if (_stricmp(strategy, "filtered") == 0)
+                    g_PdfSettings.zstrategy = Z_FILTERED;
+                else if (_stricmp(strategy, "huffman") == 0)
+                    g_PdfSettings.zstrategy = Z_HUFFMAN_ONLY;
+                else if (_stricmp(strategy, "rle") == 0)
+                    g_PdfSettings.zstrategy = Z_RLE;
+                else if (_stricmp(strategy, "fixed") == 0)
+                    g_PdfSettings.zstrategy = Z_FIXED;
+                else
+                {
+                    std::cerr << "Unknown compression strategy: " << strategy << std::endl;
+                    return false;
+                }
+            }
+            else if (_stricmp(arg + 1, "zthreads") == 0 && argn + 1 < argc)
+            {
+                g_PdfSettings.zthreads = atoi(argv[++argn]);
+                if (g_PdfSettings.zthreads < 0)
+                {
+                    std::cerr << "Wrong number of compression threads: " << argv[argn] << std::endl;
+                    return false;
+                }
+            }
+            else if (_stricmp(arg + 1, "rthreads") == 0 && argn + 1 < argc)
+            {
+                g_RasterSettings.threads = atoi(argv[++argn]);
+                if (g_RasterSettings.threads < 0)
+                {
+                    std::cerr << "Wrong number of drawing threads: " << argv[argn] << std::endl;
+                    return false;
+                }
+            }
+            else if (_stricmp(arg + 1, "index") == 0)
+                g_UsePageIndex = true;
+            else if (_stricmp(arg + 1, "pages") == 0 && argn + 1 < argc)
+            {
+                const char* range = argv[++argn];
+                char dash = 0;
+                int count = sscanf(range, "%d%c%d", &g_PageFirst, &dash, &g_PageLast);
+                if (count == 1)
+                    g_PageLast = g_PageFirst;
+                if (count < 1 || (count >= 2 && dash != '-') || g_PageFirst < 1 ||
+                    (g_PageLast != 0 && g_PageLast < g_PageFirst))
+                {
+                    std::cerr << "Wrong page range: " << range << std::endl;
+                    return false;
+                }
+            }
             else
             {
                 std::cerr << "Unknown option: " << arg << std::endl;
@@ -68,20 +185,246 @@ bool ParseCommandLine(int argc, char* argv[])
         std::cerr << "Input file is not specified." << std::endl;
         return false;
     }
+    if (g_UsePageIndex && strcmp(g_InputFileName, "-") == 0)
+    {
+        std::cerr << "The page index needs an input file." << std::endl;
+        return false;
+    }
 
     return true;
 }
 
+// Create the driver; the page drivers render the pages apart, on the worker threads already
+OutputDriver* CreateOutputDriver(int drivertype, OutputSink& output, bool pagedriver = false)
+{
+    switch (drivertype)
+    {
+    case OUTPUT_DRIVER_SVG:
+        return new OutputDriverSvg(output);
+    case OUTPUT_DRIVER_POSTSCRIPT:
+        return new OutputDriverPostScript(output);
+    case OUTPUT_DRIVER_PDF:
+        {
+            OutputDriverPdfSettings settings = g_PdfSettings;
+            if (pagedriver)
+                settings.zthreads = 0;
+            return new OutputDriverPdf(output, settings);
+        }
+    case OUTPUT_DRIVER_TXT:
+        return new OutputDriverTxt(output);
+    case OUTPUT_DRIVER_RASTER:
+        {
+            OutputDriverRasterSettings settings = g_RasterSettings;
+            if (pagedriver)
+                settings.threads = 0;
+            if (settings.format == RASTER_FORMAT_TIFF)
+                return new OutputDriverTiff(output, settings);
+            return new OutputDriverRaster(output, settings);
+        }
+    default:
+        return 0;
+    }
+}
+
+// Interpret the pages into g_pOutputDriver from the input position, and from the state if given,
+// up to the end of the input or the page g_PageLast; returns the count of the pages written
+template<class Driver>
+int RenderPages(EscInput& input, const EscInterpreterState* state, int pageno)
+{
+    Driver& driver = static_cast<Driver&>(*g_pOutputDriver);
+
+    // Single pass: the drivers get the page count at the end of the document
+    int outpageno = 1;
+    std::cerr << "Page " << pageno << " ";
+    driver.WritePageBeginning(outpageno);
+
+    // Initialize the interpreter
+    EscInterpreterT<Driver> intrpr(input, driver);
+    if (state != 0)
+        intrpr.RestoreState(*state);
+
+    // Run the interpreter to produce the pages
+    while (true)
+    {
+        if (intrpr.InterpretNext())
+            continue;
+
+        driver.WritePageEnding();
+        g_pOutput->Flush();
+        std::cerr << "\r";
+
+        if (intrpr.IsEndOfFile() || pageno == g_PageLast)
+            break;
+
+        pageno++;  outpageno++;
+        std::cerr << "Page " << pageno << " ";
+
+        driver.WritePageBeginning(outpageno);
+    }
+    std::cerr << std::endl;
+    return outpageno;
+}
+
+// Interpret the page starting with the state into the page driver, as the page outpageno
+template<class Driver>
+void RenderPage(OutputDriver& pagedriver, EscInput& input, const EscInterpreterState& state, int outpageno)
+{
+    Driver& driver = static_cast<Driver&>(pagedriver);
+    EscInterpreterT<Driver> intrpr(input, driver);
+    intrpr.RestoreState(state);
+    driver.WritePageBeginning(outpageno);
+    while (intrpr.InterpretNext()) { }
+    driver.WritePageEnding();
+}
+
+// Render functions with the interpreter typed on the driver class, so that the interpreter
+// calls the driver for every character directly, not through the vtable
+struct RenderFunctions
+{
+    int (*renderpages)(EscInput& input, const EscInterpreterState* state, int pageno);
+    void (*renderpage)(OutputDriver& pagedriver, EscInput& input, const EscInterpreterState& state, int outpageno);
+};
+
+template<class Driver>
+RenderFunctions GetRenderFunctions()
+{
+    RenderFunctions functions = { RenderPages<Driver>, RenderPage<Driver> };
+    return functions;
+}
+
+// Render functions for the drivers made by CreateOutputDriver
+RenderFunctions GetRenderFunctions(int drivertype)
+{
+    switch (drivertype)
+    {
+    case OUTPUT_DRIVER_SVG:
+        return GetRenderFunctions<OutputDriverSvg>();
+    case OUTPUT_DRIVER_POSTSCRIPT:
+        return GetRenderFunctions<OutputDriverPostScript>();
+    case OUTPUT_DRIVER_PDF:
+        return GetRenderFunctions<OutputDriverPdf>();
+    case OUTPUT_DRIVER_TXT:
+        return GetRenderFunctions<OutputDriverTxt>();
+    case OUTPUT_DRIVER_RASTER:  // OutputDriverTiff too, its character methods are those of OutputDriverRaster
+        return GetRenderFunctions<OutputDriverRaster>();
+    default:
+        return GetRenderFunctions<OutputDriver>();
+    }
+}
+
+// Render the pages pagefirst..pagelast on g_Jobs threads.
+// Every page is rendered by its own driver into a buffer, starting from the state
+// saved in the index; the buffers are appended to g_pOutputDriver in page order.
+bool RenderPagesParallel(const EscPageIndex& index, int pagefirst, int pagelast)
+{
+    const int pagecount = pagelast - pagefirst + 1;
+    const int window = g_Jobs * 4;  // Pages rendered ahead of the writer, to bound the memory used
+    const RenderFunctions functions = GetRenderFunctions(g_OutputDriverType);
+
+    std::vector<std::string> pagedata(pagecount);
+    std::vector<OutputDriver*> pagedrivers(pagecount, (OutputDriver*)0);
+    std::mutex mutex;
+    std::condition_variable cond;
+    int nextpage = 0;  // Next page to render
+    int written = 0;   // Pages appended to the document
+    bool failed = false;
+
+    std::vector<std::thread> workers;
+    for (int job = 0; job < g_Jobs; job++)
+    {
+        workers.push_back(std::thread([&]()
+        {
+            EscInput input;  // Every worker has its own view of the input
+            if (!input.Open(g_InputFileName))
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                failed = true;
+                cond.notify_all();
+                return;
+            }
+
+            while (true)
+            {
+                int i;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    cond.wait(lock, [&]() { return failed || nextpage >= pagecount || nextpage < written + window; });
+                    if (failed || nextpage >= pagecount)
+                        return;
+                    i = nextpage++;
+                }
+
+                const EscPageIndex::Page& page = index.GetPage(pagefirst + i);
+                OutputSinkString output;
+                OutputDriver* driver = CreateOutputDriver(g_OutputDriverType, output, true);
+                input.Seek(page.offset);
+                functions.renderpage(*driver, input, page.state, i + 1);
+
+                std::lock_guard<std::mutex> lock(mutex);
+                pagedata[i].swap(output.GetString());
+                pagedrivers[i] = driver;
+                cond.notify_all();
+            }
+        }));
+    }
+
+    // Append the pages in order as they are ready
+    for (int i = 0; i < pagecount; i++)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cond.wait(lock, [&]() { return failed || pagedrivers[i] != 0; });
+        if (failed)
+            break;
+        OutputDriver* driver = pagedrivers[i];
+        std::string data;
+        data.swap(pagedata[i]);
+        lock.unlock();
+
+        std::cerr << "Page " << pagefirst + i << " \r";
+        g_pOutputDriver->AppendPage(*driver, data);
+        g_pOutput->Flush();
+        delete driver;
+
+        lock.lock();
+        pagedrivers[i] = 0;
+        written++;
+        cond.notify_all();
+    }
+
+    for (size_t job = 0; job < workers.size(); job++)
+        workers[job].join();
+    for (int i = 0; i < pagecount; i++)
+        delete pagedrivers[i];
+
+    return !failed;
+}
+
 // Print usage info
 void PrintUsage()
 {
     std::cerr << "Usage:" << std::endl
             << "\tESCParser [options] InputFile > OutputFile" << std::endl
+            << "\tInputFile can be - to read the standard input" << std::endl
             << "Options:" << std::endl
             << "\t" OPTIONSTR "ps\tPostScript output with multipage support" << std::endl
             << "\t" OPTIONSTR "svg\tSVG output, no multipage support" << std::endl
             << "\t" OPTIONSTR "pdf\tPDF output with multipage support" << std::endl
 			<< "\t" OPTIONSTR "txt\tTXT output" << std::endl
+            << "\t" OPTIONSTR "pbm, " OPTIONSTR "pgm, " OPTIONSTR "png\tPage images, one after another for the pages" << std::endl
+            << "\t" OPTIONSTR "tiff\tMulti-page TIFF, CCITT Group 4 compressed" << std::endl
+            << "\t" OPTIONSTR "pages N[-[M]]\tOutput only the given page range" << std::endl
+            << "\t" OPTIONSTR "index\tUse the page index file InputFile.idx to seek to the pages,"
+            << " create it if needed" << std::endl
+            << "\t" OPTIONSTR "ascii85\tPDF: ASCII85-encode the streams, for 7-bit safe output" << std::endl
+            << "\t" OPTIONSTR "zlevel N\tPDF/PNG: compression level, 0 (none) to 9 (best)" << std::endl
+            << "\t" OPTIONSTR "zstrategy S\tPDF: compression strategy, default|filtered|huffman|rle|fixed" << std::endl
+            << "\t" OPTIONSTR "zthreads N\tPDF: deflate the pages on N threads, 0 to deflate while interpreting;"
+            << " default is one less than the cores" << std::endl
+            << "\t" OPTIONSTR "dpi N\tPBM/PGM/PNG/TIFF: resolution, 300 by default" << std::endl
+            << "\t" OPTIONSTR "aa\tPGM/PNG: anti-aliased grayscale" << std::endl
+            << "\t" OPTIONSTR "rthreads N\tPBM/PGM/PNG/TIFF: draw the bands of a page on N threads, 0 to draw"
+            << " on the interpreter thread; default is the cores" << std::endl
+            << "\t" OPTIONSTR "jobs N\tRender N pages in parallel, 0 to use all the cores" << std::endl
 			;
 }
 
@@ -95,101 +438,134 @@ int main(int argc, char* argv[])
         return 1;
     }
 
-    // Choose a proper output driver
-    switch (g_OutputDriverType)
+    // Choose a proper output driver, writing to the standard output
+    OutputSinkFile output(1);
+    g_pOutput = &output;
+    g_pOutputDriver = CreateOutputDriver(g_OutputDriverType, output);
+    if (g_pOutputDriver == 0)
     {
-    case OUTPUT_DRIVER_SVG:
-        g_pOutputDriver = new OutputDriverSvg(std::cout);
-        break;
-    case OUTPUT_DRIVER_POSTSCRIPT:
-        g_pOutputDriver = new OutputDriverPostScript(std::cout);
-        break;
-    case OUTPUT_DRIVER_PDF:
-        g_pOutputDriver = new OutputDriverPdf(std::cout);
-        break;
-    case OUTPUT_DRIVER_TXT:
-        g_pOutputDriver = new OutputDriverTxt(std::cout);
-        break;
-    default:
         std::cerr << "Output driver type is not defined." << std::endl;
         return 1;
     }
 
-    // First run: calculate total page count
-    int pagestotal = 1;
+    // Prepare the input stream
+    EscInput input;
+    if (!input.Open(g_InputFileName))
     {
-        // Prepare the input stream
-        std::ifstream input(g_InputFileName, std::ifstream::in | std::ifstream::binary);
-        if (input.fail())
+        std::cerr << "Failed to open the input file." << std::endl;
+        return 1;
+    }
+
+    // Find the state at the start of the first page to output
+    int pageno = 1;
+    EscInterpreterState state;
+    bool hasstate = false;
+    EscPageIndex index;
+    bool hasindex = false;
+    bool parallel = g_Jobs > 1 && g_pOutputDriver->CanRenderPagesApart();
+    if (g_UsePageIndex)
+    {
+        std::string indexname = std::string(g_InputFileName) + ".idx";
+        if (!index.ReadSignature(input))
         {
-            std::cerr << "Failed to open the input file." << std::endl;
+            std::cerr << "The page index needs a seekable input file." << std::endl;
             return 1;
         }
-
-        // Prepare stub driver
-        OutputDriverStub driverstub(std::cout);
-
-        // Run the interpreter to count the pages
-        EscInterpreter intrpr1(input, driverstub);
-        while (true)
+        if (!index.Load(indexname.c_str()))
         {
-            if (!intrpr1.InterpretNext())
-            {
-                if (intrpr1.IsEndOfFile())
-                    break;
-
-                pagestotal++;
-            }
+            std::cerr << "Building the page index " << indexname << std::endl;
+            index.Build(input);
+            if (!index.Save(indexname.c_str()))
+                std::cerr << "Failed to write the page index file." << std::endl;
+        }
+        hasindex = true;
+    }
+    else if (parallel)
+    {
+        // The page starts are needed to render the pages apart
+        if (input.Seek(0))
+        {
+            index.Build(input);
+            hasindex = true;
+        }
+        else
+        {
+            std::cerr << "Parallel rendering needs a seekable input file, rendering serially." << std::endl;
+            parallel = false;
         }
     }
 
-    std::cerr << "Pages total: " << pagestotal << std::endl;
-
-    // Second run: output the pages
+    if (hasindex)
     {
-        // Prepare the input stream
-        std::ifstream input(g_InputFileName, std::ifstream::in | std::ifstream::binary);
-        if (input.fail())
+        if (g_PageFirst > index.GetPageCount())
         {
-            std::cerr << "Failed to open the input file." << std::endl;
+            std::cerr << "Page " << g_PageFirst << " not found, pages total: " << index.GetPageCount() << std::endl;
             return 1;
         }
-
-        // Prepare the output driver
-        g_pOutputDriver->WriteBeginning(pagestotal);
-        int pageno = 1;
-        std::cerr << "Page " << pageno << " ";
-        g_pOutputDriver->WritePageBeginning(pageno);
-
-        // Initialize the interpreter
-        EscInterpreter intrpr(input, *g_pOutputDriver);
-
-        // Run the interpreter to produce the pages
-        while (true)
+        const EscPageIndex::Page& page = index.GetPage(g_PageFirst);
+        input.Seek(page.offset);
+        state = page.state;
+        hasstate = true;
+        pageno = g_PageFirst;
+    }
+    else if (g_PageFirst > 1)
+    {
+        // No index: interpret the pages to skip without output
+        OutputDriverNull drivernull;
+        EscInterpreterT<OutputDriverNull> intrpr(input, drivernull);
+        while (pageno < g_PageFirst)
         {
             if (intrpr.InterpretNext())
                 continue;
-
-            g_pOutputDriver->WritePageEnding();
-            std::cerr << "\r";
-
             if (intrpr.IsEndOfFile())
                 break;
-
             pageno++;
-            std::cerr << "Page " << pageno << " ";
+        }
+        if (pageno < g_PageFirst)
+        {
+            std::cerr << "Page " << g_PageFirst << " not found, pages total: " << pageno << std::endl;
+            return 1;
+        }
+        intrpr.SaveState(state);
+        hasstate = true;
+    }
 
-            g_pOutputDriver->WritePageBeginning(pageno);
+    int pagestotal = 0;
+    g_pOutputDriver->WriteBeginning();
+    if (parallel)
+    {
+        int pagelast = index.GetPageCount();
+        if (g_PageLast != 0 && g_PageLast < pagelast)
+            pagelast = g_PageLast;
+        pagestotal = pagelast - g_PageFirst + 1;
+
+        if (!RenderPagesParallel(index, g_PageFirst, pagelast))
+        {
+            std::cerr << "Failed to open the input file." << std::endl;
+            return 1;
         }
         std::cerr << std::endl;
-
-        g_pOutputDriver->WriteEnding();
     }
+    else
+    {
+        pagestotal = GetRenderFunctions(g_OutputDriverType).renderpages(input, hasstate ? &state : 0, pageno);
+    }
+
+    g_pOutputDriver->WriteEnding(pagestotal);
+    output.Flush();
+
+    std::cerr << "Pages total: " << pagestotal << std::endl;
 
     // Cleanup
     delete g_pOutputDriver;
     g_pOutputDriver = 0;
 
+    if (output.IsFailed())
+    {
+        std::cerr << "Failed to write the output." << std::endl;
+        return 1;
+    }
+
     return 0;
 }
 
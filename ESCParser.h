@@ -11,16 +11,167 @@ UKNCBTL. If not, see <http://www.gnu.org/licenses/>. */
 #ifndef _ESCPARSER_H_
 #define _ESCPARSER_H_
 
+#include <bitset>
 #include <iostream>
+#include <map>
+#include <string>
 #include <vector>
 
-#ifndef WIN32
 #include <string.h>
+#ifndef WIN32
 #define sprintf_s snprintf
 #define _stricmp  strcasecmp
 #endif
 
 extern unsigned short RobotronFont[];
+struct glyph;
+
+//////////////////////////////////////////////////////////////////////
+// Input
+
+// Input byte source for the interpreter.
+// Regular files are memory-mapped and consumed as one contiguous span;
+// pipes and devices fall back to reading by large blocks.
+class EscInput
+{
+protected:
+    const unsigned char* m_pos;   // Next byte to read
+    const unsigned char* m_end;   // End of the bytes available
+    const unsigned char* m_data;  // Start of the mapping or of the block buffer
+    size_t m_dataoffset;          // Input offset of m_data
+    bool   m_eof;                 // Set after an attempt to read past the end
+    int    m_fd;
+    void*  m_mapping;
+    size_t m_mappingsize;
+    std::vector<unsigned char> m_buffer;
+
+public:
+    EscInput();
+    ~EscInput();
+
+    // Open the input file, "-" means the standard input; returns false on failure
+    bool Open(const char* filename);
+    void Close();
+
+    // Retrieve a next byte from the input, 0 after the end of input
+    unsigned char GetNextByte()
+    {
+        if (m_pos < m_end || Refill())
+            return *m_pos++;
+        m_eof = true;
+        return 0;
+    }
+    // is the end of input reached
+    bool IsEndOfFile() const { return m_eof; }
+    // Offset of the next byte to read
+    size_t GetOffset() const { return m_dataoffset + (m_pos - m_data); }
+    // Move to the given offset; fails on pipes
+    bool Seek(size_t offset);
+    // Get the bytes available from the current position as one span, and skip them;
+    // returns false at the end of input
+    bool GetSpan(const unsigned char*& data, size_t& size);
+
+protected:
+    // Read the next block of a non-mapped input; returns false at the end
+    bool Refill();
+
+private:
+    EscInput(const EscInput&);
+    EscInput& operator=(const EscInput&);
+};
+
+//////////////////////////////////////////////////////////////////////
+// Output sinks
+
+// Buffered byte output for the drivers.
+// The bytes are collected in a large reusable buffer, passed to the back end when
+// the buffer is full or on Flush(); the sink counts the bytes written by itself.
+class OutputSink
+{
+protected:
+    std::vector<char> m_buffer;
+    size_t m_used;                 // Bytes waiting in m_buffer
+    unsigned long long m_drained;  // Bytes passed to the back end
+    bool m_failed;
+
+public:
+    OutputSink(size_t buffersize);
+    virtual ~OutputSink() { }
+
+    void Write(const char* data, size_t size)
+    {
+        if (size <= m_buffer.size() - m_used)
+        {
+            memcpy(&m_buffer[0] + m_used, data, size);
+            m_used += size;
+        }
+        else
+            WriteLarge(data, size);
+    }
+    // Pass the buffered bytes to the back end
+    void Flush();
+    // Number of bytes written to the sink
+    unsigned long long Tell() const { return m_drained + m_used; }
+    // Did the back end fail to write
+    bool IsFailed() const { return m_failed; }
+
+    OutputSink& operator<<(const char* str) { Write(str, strlen(str)); return *this; }
+    OutputSink& operator<<(const std::string& str) { Write(str.data(), str.size()); return *this; }
+    OutputSink& operator<<(char ch) { Write(&ch, 1); return *this; }
+    OutputSink& operator<<(int value);
+    OutputSink& operator<<(unsigned int value);
+    OutputSink& operator<<(long value);
+    OutputSink& operator<<(unsigned long value);
+    OutputSink& operator<<(long long value);
+    OutputSink& operator<<(unsigned long long value);
+    OutputSink& operator<<(double value);  // Formatted like std::ostream does by default
+
+protected:
+    // Write the data that does not fit in the buffer
+    void WriteLarge(const char* data, size_t size);
+    // Write the buffered bytes then the extra bytes; returns false on failure
+    virtual bool Drain(const char* data, size_t size, const char* extra, size_t extrasize) = 0;
+
+private:
+    OutputSink(const OutputSink&);
+    OutputSink& operator=(const OutputSink&);
+};
+
+// Sink to a file descriptor: file, pipe or socket
+class OutputSinkFile : public OutputSink
+{
+protected:
+    int m_fd;
+
+public:
+    OutputSinkFile(int fd);
+    virtual ~OutputSinkFile() { Flush(); }
+
+protected:
+    virtual bool Drain(const char* data, size_t size, const char* extra, size_t extrasize);
+};
+
+// Sink to memory, used for the pages rendered apart
+class OutputSinkString : public OutputSink
+{
+protected:
+    std::string m_string;
+
+public:
+    OutputSinkString() : OutputSink(16 * 1024), m_string() { }
+
+    // Get all the bytes written so far
+    std::string& GetString() { Flush(); return m_string; }
+
+protected:
+    virtual bool Drain(const char* data, size_t size, const char* extra, size_t extrasize)
+    {
+        m_string.append(data, size);
+        m_string.append(extra, extrasize);
+        return true;
+    }
+};
+
 
 //////////////////////////////////////////////////////////////////////
 // Txt chunk
@@ -66,6 +217,61 @@ public:
 };
 
 
+//////////////////////////////////////////////////////////////////////
+// Glyphs
+
+// Pin strike radius, 1/720 inch
+const float EscStrikeRadius = 6.0f;
+const float EscStrikeRadiusBold = 8.0f;
+// Shift down of the second strike in double printing, 1/720 inch
+const float EscDoubleStrikeShift = 0.33333333333333f;
+
+// Attributes a character is printed with, taken from the interpreter state
+struct EscGlyphStyle
+{
+    int  pitch;         // Character width, 1/720 inch
+    bool bold;          // Thicker pins
+    bool doublestrike;  // Every dot struck twice, see EscDoubleStrikeShift
+    bool expanded;      // Every dot doubled to the right
+    bool underline;
+    bool superscript, subscript;
+
+    float GetStrikeRadius() const { return bold ? EscStrikeRadiusBold : EscStrikeRadius; }
+};
+
+// Pin strike of a glyph, relative to the character position, 1/720 inch
+struct EscGlyphDot
+{
+    float x, y;
+};
+
+// Get the strikes printing the glyph in the given style, in the printing order;
+// bold and doublestrike are left to the strike itself, see OutputDriver::WriteGlyph
+void GetGlyphDots(const glyph* gl, const EscGlyphStyle& style, std::vector<EscGlyphDot>& dots);
+
+// Set bits of a byte, as the offsets from the high bit in ascending order;
+// decodes the graphics column bytes and the glyph rows without testing every bit
+struct EscByteBits
+{
+    unsigned char count;
+    unsigned char offsets[8];
+};
+// By the byte value
+extern const EscByteBits* const EscByteBitsTable;
+
+// Bit image graphics of one ESC K/L/Y/Z/* command
+struct EscGraphics
+{
+    const unsigned char* data;  // Column bytes, top pin in the high bit; 3 bytes a column for 24 pins
+    int   columns;
+    int   pins;          // 8 or 24
+    int   pinpitch;      // Distance between the pins, 1/720 inch: 12 is 1/60 inch, 4 is 1/180 inch
+    int   dx;            // Distance between the columns, 1/720 inch
+    float radius;        // Strike radius, see EscStrikeRadius
+    bool  doublestrike;  // Every dot struck twice, see EscDoubleStrikeShift
+};
+
+
 //////////////////////////////////////////////////////////////////////
 // Output drivers
 
@@ -75,24 +281,40 @@ enum
     OUTPUT_DRIVER_SVG = 1,
     OUTPUT_DRIVER_POSTSCRIPT = 2,
     OUTPUT_DRIVER_PDF = 3,
-	OUTPUT_DRIVER_TXT = 4
+	OUTPUT_DRIVER_TXT = 4,
+    OUTPUT_DRIVER_RASTER = 5
 };
 
 // Base abstract class for output drivers
 class OutputDriver
 {
 protected:
-    std::ostream& m_output;
+    OutputSink& m_output;
+
+private:
+    // Strikes of the glyphs written in one style, every glyph built at its first use, see WriteGlyph
+    struct GlyphDotsCache
+    {
+        std::bitset<256> built;
+        std::vector<EscGlyphDot> dots[256];  // By the glyph index in the font ROM
+    };
+    std::map<unsigned int, GlyphDotsCache> m_glyphdotscache;  // By the style key
+    unsigned int m_glyphdotskey;       // Style key of the last glyph written, 0 if none
+    GlyphDotsCache* m_glyphdotslast;   // Cache of that style
+
+protected:
+    // Strikes of the glyph in the style relative to the character position, see GetGlyphDots
+    const std::vector<EscGlyphDot>& GetGlyphStrikes(const glyph* gl, const EscGlyphStyle& style);
 
 public:
-    OutputDriver(std::ostream& output) : m_output(output) { }
+    OutputDriver(OutputSink& output) : m_output(output), m_glyphdotskey(0), m_glyphdotslast(0) { }
     virtual ~OutputDriver() { }
 
 public:
     // Write beginning of the document
-    virtual void WriteBeginning(int pagestotal) { }  // Overwrite if needed
-    // Write ending of the document
-    virtual void WriteEnding() { }  // Overwrite if needed
+    virtual void WriteBeginning() { }  // Overwrite if needed
+    // Write ending of the document, the page count is known only here
+    virtual void WriteEnding(int pagestotal) { }  // Overwrite if needed
     // Write beginning of the page
     virtual void WritePageBeginning(int pageno) { }  // Overwrite if needed
     // Write ending of the page
@@ -101,103 +323,407 @@ public:
     virtual void WriteStrike(float x, float y, float r) = 0;  // Always overwrite
 	// Write a character
 	virtual void WriteChar(unsigned short ch, int x, int y, int w, int h) { }
+    // Write a character glyph at the character position, the style has the pitch and the attributes;
+    // by default the glyph goes to WriteStrike pin by pin, overwrite to draw or reuse whole glyphs
+    virtual void WriteGlyph(const glyph* gl, int x, int y, const EscGlyphStyle& style);
+    // Write bit image graphics, x and y are the position of the first column top pin;
+    // by default the graphics goes to WriteStrike pin by pin, overwrite to draw it as an image
+    virtual void WriteGraphics(const EscGraphics& graphics, int x, int y);
+
+public:  // Page-parallel rendering
+    // Can the pages be rendered apart, by separate driver instances
+    virtual bool CanRenderPagesApart() const { return true; }  // Overwrite if pages depend on each other
+    // Append the page rendered by another driver instance of the same type,
+    // pagedata is what that driver wrote from WritePageBeginning to WritePageEnding
+    virtual void AppendPage(const OutputDriver& pagedriver, const std::string& pagedata)
+    {
+        m_output.Write(pagedata.data(), pagedata.size());
+    }
 };
 
 // Stub driver, does nothing
 class OutputDriverStub : public OutputDriver
 {
 public:
-    OutputDriverStub(std::ostream& output) : OutputDriver(output) { };
+    OutputDriverStub(OutputSink& output) : OutputDriver(output) { };
 
 public:
     virtual void WriteStrike(float x, float y, float r) { }
+    virtual void WriteGlyph(const glyph* gl, int x, int y, const EscGlyphStyle& style) { }
+    virtual void WriteGraphics(const EscGraphics& graphics, int x, int y) { }
+};
+
+// Driver for the interpreter passes with no output, as OutputDriverStub but not derived from
+// OutputDriver: EscInterpreterT<OutputDriverNull> makes no calls at all
+class OutputDriverNull
+{
+public:
+    void WriteChar(unsigned short ch, int x, int y, int w, int h) { }
+    void WriteGlyph(const glyph* gl, int x, int y, const EscGlyphStyle& style) { }
+    void WriteGraphics(const EscGraphics& graphics, int x, int y) { }
 };
 
 // Dumb driver, just print text
-class OutputDriverTxt : public OutputDriverStub
+class OutputDriverTxt final : public OutputDriverStub
 {
 protected:
     TxtChunk m_txt;
 public:
-    OutputDriverTxt(std::ostream& output) : OutputDriverStub(output), m_txt() { };
-	virtual void WriteEnding();
+    OutputDriverTxt(OutputSink& output) : OutputDriverStub(output), m_txt() { };
+	virtual void WriteEnding(int pagestotal);
 	virtual void WriteChar(unsigned short ch, int x, int y, int w, int h);
+    // Text lines continue over the page breaks
+    virtual bool CanRenderPagesApart() const { return false; }
 };
 
 
 // SVG driver, for one-page output only
-class OutputDriverSvg : public OutputDriver
+class OutputDriverSvg final : public OutputDriver
 {
 public:
-    OutputDriverSvg(std::ostream& output) : OutputDriver(output) { };
+    OutputDriverSvg(OutputSink& output) : OutputDriver(output) { };
 
 public:
-    virtual void WriteBeginning(int pagestotal);
-    virtual void WriteEnding();
+    virtual void WriteBeginning();
+    virtual void WriteEnding(int pagestotal);
     virtual void WriteStrike(float x, float y, float r);
+    virtual void WriteGlyph(const glyph* gl, int x, int y, const EscGlyphStyle& style);
+    virtual void AppendPage(const OutputDriver& pagedriver, const std::string& pagedata);
+
+private:
+    // Glyphs printed in one style; every glyph is a symbol defined at the document end
+    // and referred to by a <use> element for every character
+    struct GlyphSymbols
+    {
+        EscGlyphStyle style;
+        std::bitset<256> used;  // Glyphs used in the document
+    };
+    std::map<unsigned int, GlyphSymbols> glyphsymbols;  // By the style key
 };
 
 // PostScript driver with multipage support
-class OutputDriverPostScript : public OutputDriver
+class OutputDriverPostScript final : public OutputDriver
 {
 public:
-    OutputDriverPostScript(std::ostream& output) : OutputDriver(output) { };
+    OutputDriverPostScript(OutputSink& output) :
+        OutputDriver(output), stringopen(false), textfont(0), textx(0), texty(0) { };
 
 public:
-    virtual void WriteBeginning(int pagestotal);
-    virtual void WriteEnding();
+    virtual void WriteBeginning();
+    virtual void WriteEnding(int pagestotal);
     virtual void WritePageBeginning(int pageno);
     virtual void WritePageEnding();
     virtual void WriteStrike(float x, float y, float r);
+    virtual void WriteGlyph(const glyph* gl, int x, int y, const EscGlyphStyle& style);
+    virtual void WriteGraphics(const EscGraphics& graphics, int x, int y);
+
+private:
+    // Show the glyph string collected, if any
+    void EndText();
+
+private:
+    // The characters are shown with Type3 fonts defined in the prologue, built from the
+    // font ROM for every glyph style at its first use; the codes are the glyph indices
+    std::string textbuf;   // Glyph string not shown yet
+    bool stringopen;       // Is a glyph string collected
+    unsigned int textfont; // Style key of the current font of the page, 0 if none
+    int textx, texty;      // Position the glyph string has advanced to
 };
 
 
 struct PdfXrefItem
 {
-    std::streamoff offset;
+    unsigned long long offset;
     int size;
     char flag;
 public:
-    PdfXrefItem(std::streamoff anoffset, int asize, char aflag)
+    PdfXrefItem(unsigned long long anoffset, int asize, char aflag)
     {
         offset = anoffset;
         size = asize;
         flag = aflag;
     }
 };
+struct z_stream_s;
+
+// PDF driver settings, from the command line
+struct OutputDriverPdfSettings
+{
+    bool ascii85;    // ASCII85-encode the streams, for 7-bit transports
+    int  zlevel;     // zlib compression level 0..9, -1 for the zlib default
+    int  zstrategy;  // zlib compression strategy, Z_DEFAULT_STRATEGY etc.
+    int  zthreads;   // Threads deflating the page content, 0 to deflate on the interpreter thread
+
+    OutputDriverPdfSettings() : ascii85(false), zlevel(-1), zstrategy(0), zthreads(0) { }
+};
+
+// Deflates and encodes a PDF stream data, by chunks
+class PdfStreamEncoder
+{
+public:
+    PdfStreamEncoder(const OutputDriverPdfSettings& settings);
+    ~PdfStreamEncoder();
+
+public:
+    // Start a new stream; returns false if the stream goes uncompressed
+    bool Begin();
+    // Deflate the data and write it out encoded; finish completes the stream
+    void Write(OutputSink& output, const char* data, size_t size, bool finish);
+
+private:
+    void WriteEncoded(OutputSink& output, const unsigned char* data, size_t size);
+    void WriteEncodedEnd(OutputSink& output);
+
+private:
+    OutputDriverPdfSettings m_settings;
+    z_stream_s* m_zstrm;     // Deflate state for the current stream, 0 when not compressing
+    std::vector<unsigned char> m_zbuffer;  // Deflate output chunk
+    unsigned char m_a85tuple[4];  // ASCII85 bytes waiting for a complete tuple
+    int m_a85count;
+
+private:
+    PdfStreamEncoder(const PdfStreamEncoder&);
+    PdfStreamEncoder& operator=(const PdfStreamEncoder&);
+};
+
+struct PdfPageJob;
+class PdfCompressor;
+
 // PDF driver with multipage support
-class OutputDriverPdf : public OutputDriver
+class OutputDriverPdf final : public OutputDriver
 {
 public:
-    OutputDriverPdf(std::ostream& output) : OutputDriver(output) { strikesize = 0.1f; };
+    OutputDriverPdf(OutputSink& output, const OutputDriverPdfSettings& settings);
+    virtual ~OutputDriverPdf();
 
 public:
-    virtual void WriteBeginning(int pagestotal);
-    virtual void WriteEnding();
+    virtual void WriteBeginning();
+    virtual void WriteEnding(int pagestotal);
     virtual void WritePageBeginning(int pageno);
     virtual void WritePageEnding();
     virtual void WriteStrike(float x, float y, float r);
-	virtual void WriteChar(unsigned short ch, int x, int y, int w, int h);
+    virtual void WriteGlyph(const glyph* gl, int x, int y, const EscGlyphStyle& style);
+    virtual void WriteGraphics(const EscGraphics& graphics, int x, int y);
+    virtual void AppendPage(const OutputDriver& pagedriver, const std::string& pagedata);
 
 private:
+    // Offset in the document of the next byte written; the driver does not rely on the
+    // position of the output, which has no meaning for pipes and sockets
+    unsigned long long GetOffset() const { return m_output.Tell() - docstart; }
+
+    // Add to the page content stream, deflating it by chunks;
+    // with the compression threads, the page content is collected whole
+    void AppendContent(const char* str)
+    {
+        pagebuf.append(str);
+        if (pagebuf.length() >= PdfContentChunkSize && compressor == 0)
+            DeflateContent(false);
+    }
+    // Deflate the content collected in pagebuf and write it out
+    void DeflateContent(bool finish);
+    // Write the page objects up to the content stream data, and after it
+    void WritePageObjects(int pageno, bool compressed);
+    void WritePageObjectsEnd(unsigned long long streamlength);
+    // Write the pages deflated by the compression threads, in page order,
+    // waiting until at most maxpending pages are left in progress
+    void WriteFinishedPages(size_t maxpending);
+    // Close the text object of the page content, if any
+    void EndText();
+    // Write a stream object with the whole data known, encoded as the content streams
+    void WriteStreamObject(int objno, const std::string& data);
+    // Write the Type3 fonts used, add them to the resources dictionary
+    void WriteGlyphFonts(std::string& resources);
+    // Write the image XObjects of the graphics, add them to the resources dictionary
+    void WriteGraphicsImages(std::string& resources);
+
+private:
+    static const size_t PdfContentChunkSize = 64 * 1024;
+    OutputDriverPdfSettings settings;
+    unsigned long long docstart;  // Sink byte count at the start of the document
     std::vector<PdfXrefItem> xref;
-    std::string pagebuf;
+    std::string pagebuf;   // Page content not deflated yet, at most about PdfContentChunkSize
+    PdfStreamEncoder encoder;  // Content stream encoder, when deflating on this thread
+    PdfCompressor* compressor;  // Compression threads, 0 when deflating on this thread
+    int pagecurrent;       // Number of the page being interpreted
+    unsigned long long streamstart;  // Offset of the current stream data
+    int objnolength;       // Object keeping the length of the current stream
     float strikesize;
 
-protected:	
-	std::string m_txtbuf;
-    TxtChunk m_txt;
+    // Type3 font built from the font ROM, one for every glyph style used;
+    // the character codes are the glyph indices in the ROM
+    struct GlyphFont
+    {
+        EscGlyphStyle style;
+        std::bitset<256> used;  // Glyphs used in the document
+    };
+    std::map<unsigned int, GlyphFont> glyphfonts;  // By the style key, see WriteGlyph
+    bool textopen;         // Is a text object open in the page content
+    bool stringopen;       // Is a string of glyphs open in the text object
+    unsigned int textfont; // Style key of the current font of the text object
+    int textx, texty;      // Position the current glyph string has advanced to
+
+    // Graphics too large for an inline image, kept until the end of the document; named by the
+    // page number and the image number in the page, the same when the pages are rendered apart
+    struct GraphicsImage
+    {
+        int pageno, index;
+        int width, height;
+        std::string data;  // Deflated mask, ASCII85-encoded as the settings say
+    };
+    std::vector<GraphicsImage> images;
+    int pageimages;        // Images of the current page
+};
+
+
+// Image formats of the raster driver
+enum
+{
+    RASTER_FORMAT_PBM = 0,  // Netpbm bitmap, P4
+    RASTER_FORMAT_PGM = 1,  // Netpbm graymap, P5
+    RASTER_FORMAT_PNG = 2,
+    RASTER_FORMAT_TIFF = 3  // Bilevel, CCITT Group 4 compressed; see OutputDriverTiff
+};
+
+// Raster driver settings, from the command line
+struct OutputDriverRasterSettings
+{
+    int  format;     // RASTER_FORMAT_XXX
+    int  dpi;        // Resolution, pixels per inch
+    bool antialias;  // Grayscale strike edges; PBM keeps the pixels half covered or more
+    int  zlevel;     // PNG zlib compression level 0..9, -1 for the zlib default
+    int  threads;    // Threads drawing the bands of a page, 0 to draw on the interpreter thread
+
+    OutputDriverRasterSettings() : format(RASTER_FORMAT_PNG), dpi(300), antialias(false), zlevel(-1), threads(0) { }
+};
+
+class RasterBandPool;
+
+// Band of the page being drawn by the raster driver
+struct RasterBand
+{
+    int top, height;  // Page rows of the band
+    std::vector<unsigned char> bitmap;  // Band pixels, a byte each, 255 for the ink
+};
+
+// Raster driver: every page is drawn and written as an image, band by band;
+// the images of the pages follow each other in the output
+class OutputDriverRaster : public OutputDriver
+{
+public:
+    OutputDriverRaster(OutputSink& output, const OutputDriverRasterSettings& settings);
+    virtual ~OutputDriverRaster();
+
+public:
+    virtual void WritePageBeginning(int pageno);
+    virtual void WritePageEnding();
+    virtual void WriteStrike(float x, float y, float r);
+    // The character methods are final, so that EscInterpreterT<OutputDriverRaster> calls them
+    // directly for OutputDriverTiff as well
+    virtual void WriteChar(unsigned short ch, int x, int y, int w, int h) final { }
+    virtual void WriteGlyph(const glyph* gl, int x, int y, const EscGlyphStyle& style) final;
+    virtual void WriteGraphics(const EscGraphics& graphics, int x, int y) final;
+
+protected:
+    // Draw the page band by band, writing the image to the output
+    void DrawPage(OutputSink& output);
+
+private:
+    // Pin strike as pixel runs, one run a row from the top row down;
+    // relative to the pixel the strike center falls in
+    struct DotStamp
+    {
+        int top;                // Row of the first run
+        std::vector<int> runs;  // Left pixel and right pixel (exclusive) of every run
+    };
+    void BuildStamp(float r, DotStamp& stamp) const;
+    void DrawStamp(const DotStamp& stamp, float x, float y, RasterBand& band) const;
+
+    // Anti-aliased pin strike: ink coverage of the pixels around the strike center, for the center
+    // at every subpixel offset; the mask rows are padded with zero pixels to a multiple of 16 bytes
+    struct DotCoverage
+    {
+        int left, top;     // Pixel of the first mask row start, relative to the pixel of the strike center
+        int width, rows;   // Pixels a mask row, without the padding; rows a mask
+        int rowbytes;      // Bytes a mask row
+        std::vector<unsigned char> masks;  // RasterSubpixels * RasterSubpixels masks, by the offset y then x
+    };
+    void BuildCoverage(float r, DotCoverage& coverage) const;
+    void DrawCoverage(const DotCoverage& coverage, float x, float y, RasterBand& band) const;
+
+    // Pin strike kept until the page end, to be drawn on the bands it reaches
+    struct BandStrike
+    {
+        float x, y, r;
+    };
+    void DrawStrike(const BandStrike& strike, RasterBand& band) const;
+    // Draw the strikes of the band, the band drawing may run on the drawing threads
+    void DrawBand(int index, RasterBand& band) const;
+
+protected:
+    OutputDriverRasterSettings settings;
+    float scale;       // Pixels per 1/720 inch
+    int width, height; // Page size, pixels
+    std::vector<std::vector<BandStrike> > bandstrikes;  // Strikes of the page, by the bands of RasterBandRows rows
+    std::vector<RasterBand> bands;  // Bands being drawn; one, or a window of them with the drawing threads
+    RasterBandPool* bandpool;  // Drawing threads, 0 when drawing on this thread
+    DotStamp stamp;      // For EscStrikeRadius
+    DotStamp stampbold;  // For EscStrikeRadiusBold
+    DotCoverage coverage;      // For EscStrikeRadius, when anti-aliasing
+    DotCoverage coveragebold;  // For EscStrikeRadiusBold, when anti-aliasing
+};
+
+// TIFF driver: the pages are bilevel images compressed with CCITT Group 4, an image file directory
+// a page; every directory links to the next one, so a page is written when the next page comes
+// or the document ends
+class OutputDriverTiff : public OutputDriverRaster
+{
+public:
+    OutputDriverTiff(OutputSink& output, const OutputDriverRasterSettings& settings);
+
+public:
+    virtual void WriteBeginning();
+    virtual void WriteEnding(int pagestotal);
+    virtual void WritePageEnding();
+    virtual void AppendPage(const OutputDriver& pagedriver, const std::string& pagedata);
+
+private:
+    // Write the page kept, its directory linking to the next page unless this page is the last
+    void WritePendingPage(bool last);
+
+private:
+    unsigned long long docstart;  // Sink byte count at the start of the document
+    bool pagepending;      // Is a page kept
+    std::string pagestrip; // Group 4 data of the page kept
 };
 
 
 //////////////////////////////////////////////////////////////////////
 // ESC/P interpreter
 
-class EscInterpreter
+// Snapshot of the interpreter state, see EscInterpreter members for the meaning
+struct EscInterpreterState
+{
+    int  x, y;
+    int  marginleft, margintop;
+    int  limitright, limitbottom;
+    int  shiftx, shifty;
+    bool printmode;
+    bool fontsp, fontdo, fontfe, fontks, fontel, fontun;
+    bool superscript, subscript;
+    bool italics, prctl;
+    unsigned char msb01, charset;
+};
+
+// The interpreter calls the driver through the Driver type given: OutputDriver for any driver,
+// virtual calls; a driver class with the character methods final, direct calls; or a driver class
+// without virtual methods, the calls inlined, see OutputDriverNull.
+// The instantiations are at the end of Interpreter.cpp.
+template<class Driver>
+class EscInterpreterT
 {
 private:  // Input and output
-    std::istream& m_input;
-    OutputDriver& m_output;
+    EscInput& m_input;
+    Driver& m_output;
 
 private:  // Current state
     // Units for all the int values are equal to 1/10 point = 1/720 inch
@@ -220,22 +746,30 @@ private:  // Current state
 	bool m_prctl;       // printable control codes
 	unsigned char m_msb01; // force msb
 	unsigned char m_charset;  // Character set number
+    EscGlyphStyle m_glyphstyle;  // Style of the printed characters, see UpdateGlyphStyle()
+    std::vector<unsigned char> m_graphicsdata;  // Column bytes of the graphics being printed
 
 public:
     // Constructor
-    EscInterpreter(std::istream& input, OutputDriver& output);
+    EscInterpreterT(EscInput& input, Driver& output);
     // Interpret next character or escape sequense
     bool InterpretNext();
     // Interpret escape sequence
     bool InterpretEscape();
     // is the end of input stream reached
-    bool IsEndOfFile() const { return m_input.eof(); }
+    bool IsEndOfFile() const { return m_input.IsEndOfFile(); }
+    // Save the current state, to resume the interpretation later
+    void SaveState(EscInterpreterState& state) const;
+    // Restore the state saved by SaveState()
+    void RestoreState(const EscInterpreterState& state);
 
 protected:
     // Retrieve a next byte from the input
-    unsigned char GetNextByte();
+    unsigned char GetNextByte() { return m_input.GetNextByte(); }
     // Update m_shiftx according to current font settings
     void UpdateShiftX();
+    // Update m_glyphstyle according to current font settings
+    void UpdateGlyphStyle();
     // Increment m_y by shifty; proceed to the next page if needed
     void ShiftY(int shifty);
     // End the current page
@@ -246,10 +780,49 @@ protected:
     void printGR9(int dx, bool dblspeed = false);
     // Print graphics
     void printGR24(int dx);
+    // Pass the graphics columns collected in m_graphicsdata to the output, advance m_x
+    void DrawGraphics(int pins, int pinpitch, int dx);
     // Print the symbol using current charset
     void PrintCharacter(unsigned char ch);
-    // Draw strike made by one pin
-    void DrawStrike(float x, float y);
+};
+
+typedef EscInterpreterT<OutputDriver> EscInterpreter;
+
+
+//////////////////////////////////////////////////////////////////////
+// Page index
+
+// Input offset and interpreter state for every page start, so that any page
+// can be rendered without interpreting the pages before it.
+// The index is kept in a sidecar file, validated by the input size and CRC.
+class EscPageIndex
+{
+public:
+    struct Page
+    {
+        size_t offset;
+        EscInterpreterState state;
+    };
+
+protected:
+    std::vector<Page> m_pages;
+    unsigned long long m_inputsize;
+    unsigned long m_inputcrc;
+
+public:
+    EscPageIndex() : m_pages(), m_inputsize(0), m_inputcrc(0) { }
+
+    // Compute size and CRC of the input; leaves the input at its beginning
+    bool ReadSignature(EscInput& input);
+    // Interpret the whole input to find the page starts; call ReadSignature() first
+    void Build(EscInput& input);
+    // Load the sidecar file, fails if it does not match the signature read
+    bool Load(const char* filename);
+    bool Save(const char* filename) const;
+
+    int GetPageCount() const { return (int)m_pages.size(); }
+    // Get the page start, pageno is 1-based
+    const Page& GetPage(int pageno) const { return m_pages[pageno - 1]; }
 };
 
 
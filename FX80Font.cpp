@@ -513,8 +513,6 @@
 #define _XXXXXXXX 0x01fe
 #define XXXXXXXXX 0x01ff
 
-static struct glyph *Font[256];
-
 #define GL(p,a,L1,L2,L3,L4,L5,L6,L7,L8,L9) { \
 	a,{L1,L2,L3,L4,L5,L6,L7,L8,L9}}
 
@@ -3096,32 +3094,45 @@ cs_it[] = {{91,5},{93,30},{96,2},{123,0},{124,3},{125,1},{126,4}},
 cs_sp[] = {{35,12},{91,7},{92,9},{93,8},{123,22},{124,10}},
 cs_jp[] = {{92,31}};
 
-static void FontDef(struct FontMap map[], int n) {
+// Glyph indices in the font ROM, by the charset and the character; charset 0 is the ROM as is.
+// Filled once, at the static initialization, read only afterwards: safe for the page threads
+#define FONT_CHARSETS 9
+static unsigned char FontCharsets[FONT_CHARSETS][256];
+
+static void FontDef(unsigned char *font, const struct FontMap map[], int n) {
 	for(int i=0; i<n; ++i) {
 		int pos = map[i].pos, glyph = map[i].glyph;
-		Font[pos+000] = &FontRom[glyph+000];
-		Font[pos+128] = &FontRom[glyph+128];
+		font[pos+000] = (unsigned char)(glyph+000);
+		font[pos+128] = (unsigned char)(glyph+128);
 	}
 }
 
-#define FD(x) FontDef(x,sizeof(x)/sizeof(x[0]))
+#define FD(c,x) FontDef(FontCharsets[c],x,sizeof(x)/sizeof(x[0]))
 
-struct glyph *FontGlyph(unsigned int charset, unsigned char ch) {
-	static unsigned int last;
-	
-	if(last != charset || !Font[0]) {
-		last = charset;
-		for(int i=0; i<256; ++i) Font[i] = &FontRom[i];
-		switch(charset) {
-			case 1: FD(cs_fr); break;
-			case 2: FD(cs_de); break;
-			case 3: FD(cs_uk); break;
-			case 4: FD(cs_dk); break;
-			case 5: FD(cs_sw); break;
-			case 6: FD(cs_it); break;
-			case 7: FD(cs_sp); break;
-			case 8: FD(cs_jp); break;
-		}
+static struct FontCharsetsInit {
+	FontCharsetsInit() {
+		for(int c=0; c<FONT_CHARSETS; ++c)
+			for(int i=0; i<256; ++i) FontCharsets[c][i] = (unsigned char)i;
+		FD(1,cs_fr);
+		FD(2,cs_de);
+		FD(3,cs_uk);
+		FD(4,cs_dk);
+		FD(5,cs_sw);
+		FD(6,cs_it);
+		FD(7,cs_sp);
+		FD(8,cs_jp);
 	}
-	return Font[ch];
-}
\ No newline at end of file
+} FontCharsetsInitializer;
+
+// Unknown charsets print the ROM as is
+struct glyph *FontGlyph(unsigned int charset, unsigned char ch) {
+	return &FontRom[FontCharsets[charset < FONT_CHARSETS ? charset : 0][ch]];
+}
+
+int FontGlyphIndex(const struct glyph *gl) {
+	return (int)(gl - FontRom);
+}
+
+const struct glyph *FontRomGlyph(int index) {
+	return &FontRom[index];
+}
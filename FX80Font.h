@@ -9,5 +9,9 @@ struct glyph {
 };
 
 extern struct glyph *FontGlyph(unsigned int charset, unsigned char ch);
+// index of the glyph in the font ROM, 0..255
+extern int FontGlyphIndex(const struct glyph *gl);
+// glyph of the font ROM by its index
+extern const struct glyph *FontRomGlyph(int index);
 
 #endif // _FX80_FONT_H_
\ No newline at end of file
@@ -0,0 +1,161 @@
+/*  This file is part of UKNCBTL.
+    UKNCBTL is free software: you can redistribute it and/or modify it under the terms
+of the GNU Lesser General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+    UKNCBTL is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Lesser General Public License for more details.
+    You should have received a copy of the GNU Lesser General Public License along with
+UKNCBTL. If not, see <http://www.gnu.org/licenses/>. */
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "ESCParser.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#define read  _read
+#define close _close
+#define dup   _dup
+#define lseek _lseek
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+// Block size used when the input can't be mapped
+const size_t InputBlockSize = 1024 * 1024;
+
+//////////////////////////////////////////////////////////////////////
+
+
+EscInput::EscInput() :
+    m_pos(0), m_end(0), m_data(0), m_dataoffset(0), m_eof(false),
+    m_fd(-1), m_mapping(0), m_mappingsize(0), m_buffer()
+{
+}
+
+EscInput::~EscInput()
+{
+    Close();
+}
+
+bool EscInput::Open(const char* filename)
+{
+    Close();
+
+    if (strcmp(filename, "-") == 0)
+    {
+#ifdef _WIN32
+        _setmode(0, _O_BINARY);
+#endif
+        m_fd = dup(0);
+    }
+    else
+        m_fd = open(filename, O_RDONLY | O_BINARY);
+    if (m_fd < 0)
+        return false;
+
+#ifndef _WIN32
+    struct stat st;
+    if (fstat(m_fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        void* mapping = mmap(0, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, m_fd, 0);
+        if (mapping != MAP_FAILED)
+        {
+#ifdef MADV_SEQUENTIAL
+            madvise(mapping, (size_t)st.st_size, MADV_SEQUENTIAL);
+#endif
+            m_mapping = mapping;
+            m_mappingsize = (size_t)st.st_size;
+            m_data = m_pos = (const unsigned char*)mapping;
+            m_end = m_data + m_mappingsize;
+            close(m_fd);  m_fd = -1;  // The mapping stays valid
+            return true;
+        }
+    }
+#endif
+
+    // Not mappable: read by blocks
+    m_buffer.resize(InputBlockSize);
+    m_data = m_pos = m_end = &m_buffer[0];
+    return true;
+}
+
+void EscInput::Close()
+{
+#ifndef _WIN32
+    if (m_mapping != 0)
+        munmap(m_mapping, m_mappingsize);
+#endif
+    m_mapping = 0;  m_mappingsize = 0;
+
+    if (m_fd >= 0)
+        close(m_fd);
+    m_fd = -1;
+
+    m_buffer.clear();
+    m_pos = m_end = m_data = 0;
+    m_dataoffset = 0;
+    m_eof = false;
+}
+
+bool EscInput::Refill()
+{
+    if (m_fd < 0)
+        return false;  // Mapped or closed input: nothing more to read
+
+    m_dataoffset += m_end - m_data;
+    m_data = m_pos = m_end = &m_buffer[0];
+
+    int count;
+    do
+        count = (int)read(m_fd, &m_buffer[0], (unsigned int)m_buffer.size());
+    while (count < 0 && errno == EINTR);
+    if (count <= 0)
+        return false;
+
+    m_end = m_data + count;
+    return true;
+}
+
+bool EscInput::Seek(size_t offset)
+{
+    m_eof = false;
+    if (m_mapping != 0)
+    {
+        if (offset > m_mappingsize)
+            offset = m_mappingsize;
+        m_pos = m_data + offset;
+        return true;
+    }
+
+    if (m_fd < 0 || lseek(m_fd, (off_t)offset, SEEK_SET) == (off_t) -1)
+        return false;
+    m_dataoffset = offset;
+    m_data = m_pos = m_end = &m_buffer[0];
+    return true;
+}
+
+bool EscInput::GetSpan(const unsigned char*& data, size_t& size)
+{
+    if (m_pos == m_end && !Refill())
+    {
+        m_eof = true;
+        return false;
+    }
+    data = m_pos;
+    size = m_end - m_pos;
+    m_pos = m_end;
+    return true;
+}
+
+
+//////////////////////////////////////////////////////////////////////
@@ -14,7 +14,92 @@ UKNCBTL. If not, see <http://www.gnu.org/licenses/>. */
 //////////////////////////////////////////////////////////////////////
 
 
-EscInterpreter::EscInterpreter(std::istream& input, OutputDriver& output) :
+static struct EscByteBitsInit
+{
+    EscByteBits table[256];
+    EscByteBitsInit()
+    {
+        for (int byte = 0; byte < 256; byte++)
+        {
+            table[byte].count = 0;
+            for (int offset = 0; offset < 8; offset++)
+            {
+                if (byte & (0x80 >> offset))
+                    table[byte].offsets[table[byte].count++] = (unsigned char)offset;
+            }
+        }
+    }
+} EscByteBitsInitializer;
+
+const EscByteBits* const EscByteBitsTable = EscByteBitsInitializer.table;
+
+static inline void AddGlyphDot(int col, float step, float y, bool expanded, std::vector<EscGlyphDot>& dots)
+{
+    EscGlyphDot dot = { col * step, y };
+    dots.push_back(dot);
+    if (expanded)
+    {
+        EscGlyphDot dotright = { (col + 1.0f) * step, y };
+        dots.push_back(dotright);
+    }
+}
+
+void GetGlyphDots(const glyph* gl, const EscGlyphStyle& style, std::vector<EscGlyphDot>& dots)
+{
+    dots.clear();
+
+    // Get the address of the character in the character generator
+    const unsigned short* pchardata = gl->data;
+
+    float step = float(style.pitch) / 11.0f;  // Horizontal step
+    float y = 0.0f;
+    if (style.subscript) y += 4 * 12;
+
+    // Loop for printing the character line by line
+    unsigned short prevdata = 0;
+    for (int line = 0; line < 9; line++)
+    {
+        unsigned short data = pchardata[line];
+
+        // Special handling for superscript and subscript characters
+        if ((style.superscript || style.subscript))
+        {
+            if ((line & 1) == 0)
+            {
+                prevdata = data;
+                continue;
+            }
+            else
+            {
+                data |= prevdata;  // Combine two lines of the character into one
+            }
+        }
+        if (style.underline && line == 8)
+            data = 0x1ff;
+
+        if (data != 0)  // Print the dots of the line: the set bits of the low byte from the low bit, then bit 8
+        {
+            const EscByteBits& bits = EscByteBitsTable[data & 0xff];
+            for (int i = bits.count - 1; i >= 0; i--)
+                AddGlyphDot(7 - bits.offsets[i], step, y, style.expanded, dots);
+            if (data & 0x100)
+                AddGlyphDot(8, step, y, style.expanded, dots);
+        }
+
+        y += 12;  // 12 corresponds to 1/60 inch
+    }
+
+    // For underline, add the last point
+    if (style.underline)
+    {
+        EscGlyphDot dot = { 9.0f * step, 8 * 12 };
+        dots.push_back(dot);
+    }
+}
+
+
+template<class Driver>
+EscInterpreterT<Driver>::EscInterpreterT(EscInput& input, Driver& output) :
     m_input(input), m_output(output)
 {
     m_marginleft = 96;  // 96/720 inch = 9.6 points
@@ -24,34 +109,60 @@ EscInterpreter::EscInterpreter(std::istream& input, OutputDriver& output) :
     PrinterReset();
 }
 
-unsigned char EscInterpreter::GetNextByte()
-{
-    if (m_input.eof())
-        return 0;
-    unsigned char result = (unsigned char) m_input.get();
-    return result;
-}
-
-void EscInterpreter::PrinterReset()
+template<class Driver>
+void EscInterpreterT<Driver>::PrinterReset()
 {
     m_x = m_y = 0;
     m_printmode = false;
 
     //TODO: Configure the modes using DIP switches.
     m_fontsp = m_fontdo = m_fontfe = m_fontks = m_fontel = m_fontun = false;
+    m_superscript = m_subscript = false;
     m_shifty = 720 / 6;  // 6 lines/inch
     UpdateShiftX();
     m_limitright = m_shiftx * 80;  //TODO
     m_limitbottom = 720 * 11;  // 11 inches = 66 lines
 
-    m_superscript = m_subscript = false;
     m_charset = 0;
 	m_msb01 = 0;
 	m_italics = m_prctl = false;
 }
 
+template<class Driver>
+void EscInterpreterT<Driver>::SaveState(EscInterpreterState& state) const
+{
+    state.x = m_x;  state.y = m_y;
+    state.marginleft = m_marginleft;  state.margintop = m_margintop;
+    state.limitright = m_limitright;  state.limitbottom = m_limitbottom;
+    state.shiftx = m_shiftx;  state.shifty = m_shifty;
+    state.printmode = m_printmode;
+    state.fontsp = m_fontsp;  state.fontdo = m_fontdo;  state.fontfe = m_fontfe;
+    state.fontks = m_fontks;  state.fontel = m_fontel;  state.fontun = m_fontun;
+    state.superscript = m_superscript;  state.subscript = m_subscript;
+    state.italics = m_italics;  state.prctl = m_prctl;
+    state.msb01 = m_msb01;  state.charset = m_charset;
+}
+
+template<class Driver>
+void EscInterpreterT<Driver>::RestoreState(const EscInterpreterState& state)
+{
+    m_x = state.x;  m_y = state.y;
+    m_marginleft = state.marginleft;  m_margintop = state.margintop;
+    m_limitright = state.limitright;  m_limitbottom = state.limitbottom;
+    m_shiftx = state.shiftx;  m_shifty = state.shifty;
+    m_printmode = state.printmode;
+    m_fontsp = state.fontsp;  m_fontdo = state.fontdo;  m_fontfe = state.fontfe;
+    m_fontks = state.fontks;  m_fontel = state.fontel;  m_fontun = state.fontun;
+    m_superscript = state.superscript;  m_subscript = state.subscript;
+    m_italics = state.italics;  m_prctl = state.prctl;
+    m_msb01 = state.msb01;  m_charset = state.charset;
+    m_endofpage = false;
+    UpdateGlyphStyle();
+}
+
 // Update the value of m_shiftx according to the selected font
-void EscInterpreter::UpdateShiftX()
+template<class Driver>
+void EscInterpreterT<Driver>::UpdateShiftX()
 {
     m_shiftx = 720 / 10;  // Normal spacing
     if (m_fontel)
@@ -61,9 +172,25 @@ void EscInterpreter::UpdateShiftX()
 
     if (m_fontsp)  // Spaced font
         m_shiftx *= 2;
+
+    UpdateGlyphStyle();
+}
+
+// Update the style the characters are printed with, after any change of the font state
+template<class Driver>
+void EscInterpreterT<Driver>::UpdateGlyphStyle()
+{
+    m_glyphstyle.pitch = m_shiftx;
+    m_glyphstyle.bold = m_fontfe;
+    m_glyphstyle.doublestrike = m_fontdo;
+    m_glyphstyle.expanded = m_fontsp;
+    m_glyphstyle.underline = m_fontun;
+    m_glyphstyle.superscript = m_superscript;
+    m_glyphstyle.subscript = m_subscript;
 }
 
-void EscInterpreter::ShiftY(int shifty)
+template<class Driver>
+void EscInterpreterT<Driver>::ShiftY(int shifty)
 {
     m_y += shifty;
 
@@ -71,14 +198,16 @@ void EscInterpreter::ShiftY(int shifty)
         NextPage();
 }
 
-void EscInterpreter::NextPage()
+template<class Driver>
+void EscInterpreterT<Driver>::NextPage()
 {
     m_endofpage = true;
     m_x = m_y = 0;
 }
 
 // Interpret the next token
-bool EscInterpreter::InterpretNext()
+template<class Driver>
+bool EscInterpreterT<Driver>::InterpretNext()
 {
     if (IsEndOfFile()) return false;
     m_endofpage = false;
@@ -150,7 +279,8 @@ bool EscInterpreter::InterpretNext()
 }
 
 // Interpret Escape sequence
-bool EscInterpreter::InterpretEscape()
+template<class Driver>
+bool EscInterpreterT<Driver>::InterpretEscape()
 {
     unsigned char ch = GetNextByte();
     switch (ch)
@@ -335,10 +465,12 @@ bool EscInterpreter::InterpretEscape()
         break;
     case 'G':  // Enable double printing
         m_fontdo = true;
+        UpdateGlyphStyle();
         break;
     case 'H':  // Disable double printing
         m_fontdo = false;
         m_superscript = m_subscript = false;
+        UpdateGlyphStyle();
         break;
 	case 'I': // Control code selection
         {
@@ -350,6 +482,7 @@ bool EscInterpreter::InterpretEscape()
         {
             unsigned char ss = GetNextByte();
             m_fontun = (ss != 0 && ss != '0');
+            UpdateGlyphStyle();
         }
         break;
 
@@ -358,10 +491,12 @@ bool EscInterpreter::InterpretEscape()
             unsigned char ss = GetNextByte();
             m_superscript = (ss == 0 || ss == '0');
             m_subscript = (ss == 1 || ss == '1');
+            UpdateGlyphStyle();
         }
         break;
     case 'T': // Disable printing in the upper or lower part of the line
         m_superscript = m_subscript = false;
+        UpdateGlyphStyle();
         break;
     case 'W': // Enable or disable expanded font
         {
@@ -409,14 +544,16 @@ bool EscInterpreter::InterpretEscape()
     return !m_endofpage;
 }
 
-void EscInterpreter::printGR9(int dx, bool dblspeed)
+template<class Driver>
+void EscInterpreterT<Driver>::printGR9(int dx, bool dblspeed)
 {
     int width = GetNextByte();  // Number of data "chunks" for the image
     width += 256 * (int)GetNextByte();
 
-    // Read and output data
+    // Read the data
+    m_graphicsdata.resize(width);
     unsigned char lastfbyte = 0;
-    for (; width > 0; width--)
+    for (int col = 0; col < width; col++)
     {
         unsigned char fbyte = GetNextByte();
         if (dblspeed)  // In high-speed mode, ignore consecutive strikes
@@ -424,48 +561,51 @@ void EscInterpreter::printGR9(int dx, bool dblspeed)
             fbyte &= ~lastfbyte;
             lastfbyte = fbyte;
         }
-        unsigned char mask = 0x80;
-        for (int i = 0; i < 8; i++)
-        {
-            if (fbyte & mask)
-            {
-                DrawStrike(float(m_x), float(m_y + i * 12));
-                /* 12 corresponds to 1/60 inch... In reality, the distance between needles in
-                9-pin dot matrix printers = 1/72 inch, but when emulating on a 24-pin printer, 1/60 is used */
-            }
-            mask >>= 1;
-        }
-        m_x += dx;
+        m_graphicsdata[col] = fbyte;
     }
+
+    DrawGraphics(8, 12, dx);
+    /* 12 corresponds to 1/60 inch... In reality, the distance between needles in
+    9-pin dot matrix printers = 1/72 inch, but when emulating on a 24-pin printer, 1/60 is used */
 }
 
-void EscInterpreter::printGR24(int dx)
+template<class Driver>
+void EscInterpreterT<Driver>::printGR24(int dx)
 {
     int width = GetNextByte(); // Number of data "chunks" for the image
     width += 256 * (int)GetNextByte();
 
-    // Read and output data
-    for (; width > 0; width--)
-    {
-        for (unsigned char n = 0; n < 3; n++)
-        {
-            unsigned char fbyte = GetNextByte();
-            unsigned char mask = 0x80;
-            for (int i = 0; i < 8; i++)
-            {
-                if (fbyte & mask)
-                {
-                    DrawStrike(float(m_x), float((m_y + (n * 4 * 8/*èãë*/) + i * 4)));
-                    /* 4 corresponds to 1/180 inch - the distance between needles in 24-pin dot matrix printers */
-                }
-                mask >>= 1;
-            }
-        }
-        m_x += dx;
-    }
+    // Read the data, 3 bytes a column
+    m_graphicsdata.resize(width * 3);
+    for (int i = 0; i < width * 3; i++)
+        m_graphicsdata[i] = GetNextByte();
+
+    DrawGraphics(24, 4, dx);
+    /* 4 corresponds to 1/180 inch - the distance between needles in 24-pin dot matrix printers */
 }
 
-void EscInterpreter::PrintCharacter(unsigned char ch)
+template<class Driver>
+void EscInterpreterT<Driver>::DrawGraphics(int pins, int pinpitch, int dx)
+{
+    int columns = (int)m_graphicsdata.size() / (pins / 8);
+    if (columns == 0)
+        return;
+
+    EscGraphics graphics;
+    graphics.data = &m_graphicsdata[0];
+    graphics.columns = columns;
+    graphics.pins = pins;
+    graphics.pinpitch = pinpitch;
+    graphics.dx = dx;
+    graphics.radius = m_fontfe ? EscStrikeRadiusBold : EscStrikeRadius;
+    graphics.doublestrike = m_fontdo;
+    m_output.WriteGraphics(graphics, m_marginleft + m_x, m_margintop + m_y);
+
+    m_x += dx * columns;
+}
+
+template<class Driver>
+void EscInterpreterT<Driver>::PrintCharacter(unsigned char ch)
 {
 	if(!m_prctl && ((ch&0x7F)<32)) ch = 32;
 
@@ -479,63 +619,20 @@ void EscInterpreter::PrintCharacter(unsigned char ch)
 		m_margintop + m_y + (m_subscript ? 4*12 : 0),
 		m_shiftx, 
 		(m_superscript || m_subscript) ? m_shifty/2 : m_shifty);
-	
-    // Get the address of the character in the character generator
-    const unsigned short* pchardata = gl->data;
-
-    float step = float(m_shiftx) / 11.0f;  // Horizontal step
-    float y = float(m_y);
-    if (m_subscript) y += 4 * 12;
 
-    // Loop for printing the character line by line
-    unsigned short prevdata = 0;
-    for (int line = 0; line < 9; line++)
-    {
-        unsigned short data = pchardata[line];
-
-        // Special handling for superscript and subscript characters
-        if ((m_superscript || m_subscript))
-        {
-            if ((line & 1) == 0)
-            {
-                prevdata = data;
-                continue;
-            }
-            else
-            {
-                data |= prevdata;  // Combine two lines of the character into one
-            }
-        }
-
-        for (int col = 0; col < 9; col++)  // Loop for printing the dots of the line
-        {
-            unsigned short bit = (data >> col) & 1;
-            if (m_fontun && line == 8) bit = 1;
-            if (!bit) continue;
-
-            DrawStrike(m_x + col * step, y);
-            if (m_fontsp)
-                DrawStrike(m_x + (col + 1.0f) * step, y);
-        }
-
-        y += 12;  // 12 corresponds to 1/60 inch
-    }
-
-    // For m_fontun, add the last point
-    if (m_fontun)
-        DrawStrike(m_x + 9.0f * step, float(m_y + 8 * 12));
+    m_output.WriteGlyph(gl, m_marginleft + m_x, m_margintop + m_y, m_glyphstyle);
 }
 
-void EscInterpreter::DrawStrike(float x, float y)
-{
-    float cx = float(m_marginleft) + x;
-    float cy = float(m_margintop) + y;
-    float cr = m_fontfe ? 8.0f : 6.0f;
 
-    m_output.WriteStrike(cx, cy, cr);
-	// m_fontdo: add a point 1/216 inch below
-	if(m_fontdo) m_output.WriteStrike(cx, cy+0.33333333333333f, cr);
-}
+// The interpreter for any driver, the ones for the drivers of the command line (see GetRenderFunctions),
+// and the one for the passes looking for the page starts only
+template class EscInterpreterT<OutputDriver>;
+template class EscInterpreterT<OutputDriverSvg>;
+template class EscInterpreterT<OutputDriverPostScript>;
+template class EscInterpreterT<OutputDriverPdf>;
+template class EscInterpreterT<OutputDriverTxt>;
+template class EscInterpreterT<OutputDriverRaster>;
+template class EscInterpreterT<OutputDriverNull>;
 
 
 //////////////////////////////////////////////////////////////////////
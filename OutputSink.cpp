@@ -0,0 +1,195 @@
+/*  This file is part of UKNCBTL.
+    UKNCBTL is free software: you can redistribute it and/or modify it under the terms
+of the GNU Lesser General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+    UKNCBTL is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Lesser General Public License for more details.
+    You should have received a copy of the GNU Lesser General Public License along with
+UKNCBTL. If not, see <http://www.gnu.org/licenses/>. */
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "ESCParser.h"
+
+#include <errno.h>
+#include <stdio.h>
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#include <sys/uio.h>
+#endif
+
+//////////////////////////////////////////////////////////////////////
+// OutputSink
+
+
+OutputSink::OutputSink(size_t buffersize) :
+    m_buffer(buffersize), m_used(0), m_drained(0), m_failed(false)
+{
+}
+
+void OutputSink::Flush()
+{
+    if (m_used == 0)
+        return;
+    if (!m_failed && !Drain(&m_buffer[0], m_used, 0, 0))
+        m_failed = true;
+    m_drained += m_used;
+    m_used = 0;
+}
+
+void OutputSink::WriteLarge(const char* data, size_t size)
+{
+    if (size < m_buffer.size() / 2)  // Fill the buffer up, then start a new one
+    {
+        size_t part = m_buffer.size() - m_used;
+        memcpy(&m_buffer[0] + m_used, data, part);
+        m_used += part;
+        Flush();
+        memcpy(&m_buffer[0], data + part, size - part);
+        m_used = size - part;
+        return;
+    }
+
+    // Large block: pass it along with the buffered bytes, without a copy
+    if (!m_failed && !Drain(&m_buffer[0], m_used, data, size))
+        m_failed = true;
+    m_drained += m_used + size;
+    m_used = 0;
+}
+
+OutputSink& OutputSink::operator<<(int value)
+{
+    char buffer[16];
+    int length = sprintf_s(buffer, sizeof(buffer), "%d", value);
+    Write(buffer, length);
+    return *this;
+}
+
+OutputSink& OutputSink::operator<<(unsigned int value)
+{
+    char buffer[16];
+    int length = sprintf_s(buffer, sizeof(buffer), "%u", value);
+    Write(buffer, length);
+    return *this;
+}
+
+OutputSink& OutputSink::operator<<(long value)
+{
+    return *this << (long long)value;
+}
+
+OutputSink& OutputSink::operator<<(unsigned long value)
+{
+    return *this << (unsigned long long)value;
+}
+
+OutputSink& OutputSink::operator<<(long long value)
+{
+    char buffer[24];
+    int length = sprintf_s(buffer, sizeof(buffer), "%lld", value);
+    Write(buffer, length);
+    return *this;
+}
+
+OutputSink& OutputSink::operator<<(unsigned long long value)
+{
+    char buffer[24];
+    int length = sprintf_s(buffer, sizeof(buffer), "%llu", value);
+    Write(buffer, length);
+    return *this;
+}
+
+OutputSink& OutputSink::operator<<(double value)
+{
+    char buffer[32];
+    int length = sprintf_s(buffer, sizeof(buffer), "%g", value);
+    Write(buffer, length);
+    return *this;
+}
+
+
+//////////////////////////////////////////////////////////////////////
+// OutputSinkFile
+
+// Buffer size for the file sink; the buffer is flushed at the page boundaries too
+const size_t OutputSinkFileBufferSize = 256 * 1024;
+
+
+OutputSinkFile::OutputSinkFile(int fd) :
+    OutputSink(OutputSinkFileBufferSize), m_fd(fd)
+{
+#ifdef _WIN32
+    _setmode(m_fd, _O_BINARY);
+#endif
+}
+
+#ifdef _WIN32
+
+static bool WriteAll(int fd, const char* data, size_t size)
+{
+    while (size > 0)
+    {
+        unsigned int chunk = size > 0x40000000 ? 0x40000000 : (unsigned int)size;
+        int count = _write(fd, data, chunk);
+        if (count < 0)
+            return false;
+        data += count;  size -= count;
+    }
+    return true;
+}
+
+bool OutputSinkFile::Drain(const char* data, size_t size, const char* extra, size_t extrasize)
+{
+    return WriteAll(m_fd, data, size) && WriteAll(m_fd, extra, extrasize);
+}
+
+#else
+
+bool OutputSinkFile::Drain(const char* data, size_t size, const char* extra, size_t extrasize)
+{
+    struct iovec iov[2];
+    iov[0].iov_base = (void*)data;   iov[0].iov_len = size;
+    iov[1].iov_base = (void*)extra;  iov[1].iov_len = extrasize;
+    struct iovec* piov = iov;
+    int iovcnt = 2;
+
+    while (iovcnt > 0)
+    {
+        if (piov->iov_len == 0)
+        {
+            piov++;  iovcnt--;
+            continue;
+        }
+
+        ssize_t count = writev(m_fd, piov, iovcnt);
+        if (count < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+
+        // Skip what was written, partial writes happen on pipes and sockets
+        while (count > 0)
+        {
+            size_t part = (size_t)count < piov->iov_len ? (size_t)count : piov->iov_len;
+            piov->iov_base = (char*)piov->iov_base + part;
+            piov->iov_len -= part;
+            count -= part;
+            if (piov->iov_len == 0 && iovcnt > 0)
+            {
+                piov++;  iovcnt--;
+            }
+        }
+    }
+    return true;
+}
+
+#endif
+
+
+//////////////////////////////////////////////////////////////////////
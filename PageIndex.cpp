@@ -0,0 +1,219 @@
+/*  This file is part of UKNCBTL.
+    UKNCBTL is free software: you can redistribute it and/or modify it under the terms
+of the GNU Lesser General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+    UKNCBTL is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Lesser General Public License for more details.
+    You should have received a copy of the GNU Lesser General Public License along with
+UKNCBTL. If not, see <http://www.gnu.org/licenses/>. */
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "ESCParser.h"
+#include <fstream>
+
+#include "zlib/zlib.h"
+
+//////////////////////////////////////////////////////////////////////
+// Sidecar file format, all numbers are little-endian:
+//   header  "ESCIDX1\n", input size (8 bytes), input CRC-32 (4), page count (4)
+//   pages   input offset (8), x y marginleft margintop limitright limitbottom
+//           shiftx shifty (4 each), flags (2), msb01 (1), charset (1)
+
+static const char PageIndexSignature[8] = { 'E', 'S', 'C', 'I', 'D', 'X', '1', '\n' };
+
+const size_t PageIndexHeaderSize = 8 + 8 + 4 + 4;
+const size_t PageIndexRecordSize = 8 + 8 * 4 + 2 + 1 + 1;
+
+static void PutNumber(unsigned char*& dst, unsigned long long value, int size)
+{
+    for (int i = 0; i < size; i++, value >>= 8)
+        *dst++ = (unsigned char)(value & 0xff);
+}
+
+static unsigned long long GetNumber(const unsigned char*& src, int size)
+{
+    unsigned long long value = 0;
+    for (int i = size - 1; i >= 0; i--)
+        value = (value << 8) | src[i];
+    src += size;
+    return value;
+}
+
+static int GetInt(const unsigned char*& src)
+{
+    return (int)(unsigned int)GetNumber(src, 4);
+}
+
+static unsigned short PackFlags(const EscInterpreterState& state)
+{
+    return (unsigned short)(
+            (state.printmode   ? 0x0001 : 0) |
+            (state.fontsp      ? 0x0002 : 0) |
+            (state.fontdo      ? 0x0004 : 0) |
+            (state.fontfe      ? 0x0008 : 0) |
+            (state.fontks      ? 0x0010 : 0) |
+            (state.fontel      ? 0x0020 : 0) |
+            (state.fontun      ? 0x0040 : 0) |
+            (state.superscript ? 0x0080 : 0) |
+            (state.subscript   ? 0x0100 : 0) |
+            (state.italics     ? 0x0200 : 0) |
+            (state.prctl       ? 0x0400 : 0));
+}
+
+static void UnpackFlags(EscInterpreterState& state, unsigned short flags)
+{
+    state.printmode   = (flags & 0x0001) != 0;
+    state.fontsp      = (flags & 0x0002) != 0;
+    state.fontdo      = (flags & 0x0004) != 0;
+    state.fontfe      = (flags & 0x0008) != 0;
+    state.fontks      = (flags & 0x0010) != 0;
+    state.fontel      = (flags & 0x0020) != 0;
+    state.fontun      = (flags & 0x0040) != 0;
+    state.superscript = (flags & 0x0080) != 0;
+    state.subscript   = (flags & 0x0100) != 0;
+    state.italics     = (flags & 0x0200) != 0;
+    state.prctl       = (flags & 0x0400) != 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+
+bool EscPageIndex::ReadSignature(EscInput& input)
+{
+    if (!input.Seek(0))
+        return false;
+
+    m_inputsize = 0;
+    m_inputcrc = crc32(0L, Z_NULL, 0);
+    const unsigned char* data;
+    size_t size;
+    while (input.GetSpan(data, size))
+    {
+        m_inputsize += size;
+        while (size > 0)  // crc32() takes an uInt length
+        {
+            uInt chunk = size > 0x40000000 ? 0x40000000 : (uInt)size;
+            m_inputcrc = crc32(m_inputcrc, data, chunk);
+            data += chunk;  size -= chunk;
+        }
+    }
+
+    return input.Seek(0);
+}
+
+void EscPageIndex::Build(EscInput& input)
+{
+    m_pages.clear();
+
+    // Run the interpreter with no output, the same way main() does
+    OutputDriverNull drivernull;
+    EscInterpreterT<OutputDriverNull> intrpr(input, drivernull);
+
+    Page page;
+    page.offset = input.GetOffset();
+    intrpr.SaveState(page.state);
+    m_pages.push_back(page);
+    while (true)
+    {
+        if (intrpr.InterpretNext())
+            continue;
+        if (intrpr.IsEndOfFile())
+            break;
+
+        page.offset = input.GetOffset();
+        intrpr.SaveState(page.state);
+        m_pages.push_back(page);
+    }
+
+    input.Seek(0);
+}
+
+bool EscPageIndex::Load(const char* filename)
+{
+    std::ifstream file(filename, std::ifstream::in | std::ifstream::binary);
+    if (file.fail())
+        return false;
+
+    unsigned char header[PageIndexHeaderSize];
+    if (!file.read((char*)header, sizeof(header)) ||
+        memcmp(header, PageIndexSignature, sizeof(PageIndexSignature)) != 0)
+        return false;
+    const unsigned char* src = header + sizeof(PageIndexSignature);
+    unsigned long long inputsize = GetNumber(src, 8);
+    unsigned long inputcrc = (unsigned long)GetNumber(src, 4);
+    size_t pagecount = (size_t)GetNumber(src, 4);
+    if (inputsize != m_inputsize || inputcrc != m_inputcrc || pagecount == 0)
+        return false;  // The index is for another input
+
+    // The records must fill the rest of the file exactly; a damaged page count is not trusted to allocate
+    std::streamoff recordsstart = file.tellg();
+    if (!file.seekg(0, std::ifstream::end))
+        return false;
+    std::streamoff recordssize = file.tellg() - recordsstart;
+    if (recordssize < 0 || (unsigned long long)recordssize / PageIndexRecordSize != pagecount ||
+        (unsigned long long)recordssize % PageIndexRecordSize != 0 || !file.seekg(recordsstart))
+        return false;
+
+    std::vector<unsigned char> records(pagecount * PageIndexRecordSize);
+    if (!file.read((char*)&records[0], records.size()))
+        return false;
+
+    m_pages.resize(pagecount);
+    src = &records[0];
+    for (size_t i = 0; i < pagecount; i++)
+    {
+        Page& page = m_pages[i];
+        page.offset = (size_t)GetNumber(src, 8);
+        EscInterpreterState& state = page.state;
+        state.x = GetInt(src);  state.y = GetInt(src);
+        state.marginleft = GetInt(src);  state.margintop = GetInt(src);
+        state.limitright = GetInt(src);  state.limitbottom = GetInt(src);
+        state.shiftx = GetInt(src);  state.shifty = GetInt(src);
+        UnpackFlags(state, (unsigned short)GetNumber(src, 2));
+        state.msb01 = (unsigned char)GetNumber(src, 1);
+        state.charset = (unsigned char)GetNumber(src, 1);
+
+        if (page.offset > m_inputsize)
+        {
+            m_pages.clear();
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool EscPageIndex::Save(const char* filename) const
+{
+    std::vector<unsigned char> buffer(PageIndexHeaderSize + m_pages.size() * PageIndexRecordSize);
+    unsigned char* dst = &buffer[0];
+    memcpy(dst, PageIndexSignature, sizeof(PageIndexSignature));
+    dst += sizeof(PageIndexSignature);
+    PutNumber(dst, m_inputsize, 8);
+    PutNumber(dst, m_inputcrc, 4);
+    PutNumber(dst, m_pages.size(), 4);
+
+    for (std::vector<Page>::const_iterator it = m_pages.begin(); it != m_pages.end(); ++it)
+    {
+        const EscInterpreterState& state = (*it).state;
+        PutNumber(dst, (*it).offset, 8);
+        PutNumber(dst, (unsigned int)state.x, 4);  PutNumber(dst, (unsigned int)state.y, 4);
+        PutNumber(dst, (unsigned int)state.marginleft, 4);  PutNumber(dst, (unsigned int)state.margintop, 4);
+        PutNumber(dst, (unsigned int)state.limitright, 4);  PutNumber(dst, (unsigned int)state.limitbottom, 4);
+        PutNumber(dst, (unsigned int)state.shiftx, 4);  PutNumber(dst, (unsigned int)state.shifty, 4);
+        PutNumber(dst, PackFlags(state), 2);
+        PutNumber(dst, state.msb01, 1);
+        PutNumber(dst, state.charset, 1);
+    }
+
+    std::ofstream file(filename, std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
+    if (file.fail())
+        return false;
+    file.write((const char*)&buffer[0], buffer.size());
+    return !file.fail();
+}
+
+
+//////////////////////////////////////////////////////////////////////